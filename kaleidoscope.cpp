@@ -1,9 +1,48 @@
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <iostream>
-#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef KALEIDOSCOPE_LLVM
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/TargetSelect.h>
+#endif
+
 // The lexer return tokens [0-255] if it is an unknown character,
 // otherwise one of these known things.
 // Unknown tokens are processed as-is.
@@ -17,400 +56,4782 @@ enum token {
     // primary
     tok_identifier = -4,
     tok_number = -5,
+
+    // a malformed token, already reported by the lexer
+    tok_error = -6,
+
+    // control
+    tok_if = -7,
+    tok_then = -8,
+    tok_else = -9,
 };
 
-// Global variables are used for simplicity
+// source_span - a run of characters in the source buffer. It is kept as an
+// offset rather than a pointer so it stays valid when the buffer grows.
+struct source_span {
+    uint32_t offset;
+    uint32_t length;
+};
 
-static std::string identifier_str; // Filled in if tok_identifier
-static double numeric_value;             // Filled in if tok_number
+// source_location - a 1-based line and column, in bytes
+struct source_location {
+    uint32_t line;
+    uint32_t column;
+};
 
+// source_buffer - the text the lexer scans over.
+// A regular file is mapped into memory as a whole, anything else (pipes,
+// terminals, standard input) is read in large blocks appended to an owned
+// buffer whenever the lexer runs out of characters. The buffer only grows,
+// so an offset into it stays valid for the lifetime of the source.
+class source_buffer {
+    private:
+        static constexpr size_t block_size = 1 << 16;
+        // tokens address the source by 32-bit offsets
+        static constexpr size_t max_size = UINT32_MAX;
 
-// gettok - Return the next token from standard input.
-// Read a sequence of alphanumerical characters and 
-// return corresponding token type
-static int get_token() {
-    static int last_char = ' ';
+        std::string source_name;
+        int fd;
+        bool owns_fd;
+        const char *mapped = nullptr;
+        size_t mapped_size = 0;
+        std::string buffered;
+        bool exhausted = false;
 
-    // Skip any whitespace
-    while (isspace(last_char))
-        last_char = getchar();
+        // Line table, built only as far as diagnostics have needed it.
+        // line_starts holds the offset of the first character of each line
+        // found in the first lines_scanned characters.
+        mutable std::mutex line_mutex;
+        mutable std::vector<uint32_t> line_starts = { 0 };
+        mutable size_t lines_scanned = 0;
 
-    // Handle a sequence of alphabetic characters as a known identifier or a string
-    if (isalpha(last_char)) { 
-        identifier_str = last_char;
-        while (isalnum((last_char = getchar())))
-            identifier_str += last_char;
+        source_buffer(std::string name, int fd, bool owns_fd) :
+            source_name(std::move(name)), fd(fd), owns_fd(owns_fd) {}
 
-        if (identifier_str == "def") 
-            return tok_def;
-        if (identifier_str == "extern")
-            return tok_extern;
-        return tok_identifier;
-    }
+    public:
+        source_buffer(const source_buffer&) = delete;
+        source_buffer& operator=(const source_buffer&) = delete;
 
-    // Handle a sequence of characters as a floating-point numeric value
-    if (isdigit(last_char) || last_char == '.') {
-        std::string numeric_str;
-        do {
-            numeric_str += last_char;
-            last_char = getchar();
-        } while (isdigit(last_char) || last_char == '.');
+        ~source_buffer() {
+            if (mapped)
+                munmap(const_cast<char *>(mapped), mapped_size);
+            if (owns_fd)
+                close(fd);
+        }
 
-        numeric_value = strtod(numeric_str.c_str(), 0);
-        return tok_number;
-    }
+        // from_file - map the file at path, or fall back to block reads
+        // if it can't be mapped. Returns nullptr if the file can't be opened.
+        static std::unique_ptr<source_buffer> from_file(const char *path) {
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) {
+                std::cerr << "error: cannot open " << path << ": "
+                    << strerror(errno) << "\n";
+                return nullptr;
+            }
 
-    // Handle a sequence of characters as a comment till the end of line
-    if (last_char == '#') {
-        do 
-            last_char = getchar();
-        while (last_char != EOF && last_char != '\n' && last_char != '\r');
-        if (last_char != EOF)
-            return get_token();
-    }
+            std::unique_ptr<source_buffer> source(new source_buffer(path, fd, true));
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                if (static_cast<uint64_t>(st.st_size) > max_size) {
+                    std::cerr << "error: " << path << " is larger than 4 GiB\n";
+                    return nullptr;
+                }
+                void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED) {
+                    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+                    source->mapped = static_cast<const char *>(addr);
+                    source->mapped_size = st.st_size;
+                    source->exhausted = true;
+                }
+            }
+            return source;
+        }
 
-    // Handle EOF character
-    if (last_char == EOF)
-        return tok_eof;
+        // from_string - a source held in memory, used for generated input
+        static std::unique_ptr<source_buffer> from_string(std::string name, std::string text) {
+            std::unique_ptr<source_buffer> source(new source_buffer(std::move(name), -1, false));
+            source->buffered = std::move(text);
+            source->exhausted = true;
+            return source;
+        }
 
-    // Handle other kinds of characters as plain ASCII characters
-    int this_char = last_char;
-    last_char = getchar();
-    return this_char;
+        // from_stdin - read standard input in blocks as the lexer needs it
+        static std::unique_ptr<source_buffer> from_stdin() {
+            return std::unique_ptr<source_buffer>(new source_buffer("<stdin>", STDIN_FILENO, false));
+        }
 
-}
+        const char *data() const {
+            return mapped ? mapped : buffered.data();
+        }
 
-// AST Parser goes here
-//
-// expr_ast - Base class for all expression nodes.
-class expr_ast {
-    public:
-        // TODO: Read about virtual destructors
-        virtual ~expr_ast() {}
-};
+        size_t size() const {
+            return mapped ? mapped_size : buffered.size();
+        }
 
+        const std::string &name() const {
+            return source_name;
+        }
 
-// number_expr_ast- Expression class for numeric literals like 0, 1.2345
-class number_expr_ast: public expr_ast {
-    private:
-        double value;
+        // complete - whether all of the input is in the buffer, as it is up
+        // front for a mapped file or a string
+        bool complete() const {
+            return exhausted;
+        }
 
-    public:
-        number_expr_ast(double value): value(value) {}
+        // location - line and column of offset. The line table is extended
+        // lazily up to offset, so only inputs that produce diagnostics pay
+        // for it. Safe to call from several lexer threads.
+        source_location location(uint32_t offset) const {
+            std::lock_guard<std::mutex> lock(line_mutex);
+            const char *text = data();
+            size_t limit = size();
+            while (lines_scanned <= offset && lines_scanned < limit) {
+                const void *eol = memchr(text + lines_scanned, '\n', limit - lines_scanned);
+                if (!eol) {
+                    lines_scanned = limit;
+                    break;
+                }
+                lines_scanned = static_cast<const char *>(eol) + 1 - text;
+                line_starts.push_back(lines_scanned);
+            }
+            auto line = std::upper_bound(line_starts.begin(), line_starts.end(), offset) - 1;
+            return { static_cast<uint32_t>(line - line_starts.begin() + 1), offset - *line + 1 };
+        }
+
+        // text - the characters a span covers. The view is only valid until the
+        // buffer is next refilled, so copy it if it has to outlive the token.
+        std::string_view text(source_span span) const {
+            return std::string_view(data() + span.offset, span.length);
+        }
+
+        // refill - append the next block of input. Returns false at end of input.
+        // data() may move, so callers must re-derive pointers from offsets.
+        bool refill() {
+            while (!exhausted) {
+                size_t old_size = buffered.size();
+                if (old_size + block_size > max_size) {
+                    std::cerr << "error: input is larger than 4 GiB\n";
+                    exhausted = true;
+                    break;
+                }
+                buffered.resize(old_size + block_size);
+                ssize_t n = read(fd, &buffered[old_size], block_size);
+                if (n < 0 && errno == EINTR) {
+                    buffered.resize(old_size);
+                    continue;
+                }
+                buffered.resize(old_size + (n > 0 ? n : 0));
+                if (n > 0)
+                    return true;
+                exhausted = true;
+            }
+            return false;
+        }
 };
 
-// variable_expr_ast - Expression class for referencing a variable
-class variable_expr_ast: public expr_ast {
-    private:
-        std::string name;
+// report_error - print an error message prefixed with its source position
+static void report_error(std::ostream &out, const source_buffer &source,
+        uint32_t offset, std::string_view str) {
+    source_location loc = source.location(offset);
+    out << source.name() << ":" << loc.line << ":" << loc.column
+        << ": log_error: " << str << "\n";
+}
 
-    public:
-        variable_expr_ast(const std::string &name): name (name) {}
+// keywords - every reserved word of the language. The lookup table below is
+// built from this list at compile time, so a new keyword is one more row here.
+struct keyword {
+    std::string_view spelling;
+    int kind;
 };
 
-// binary_expr_ast - expression class for a binary operator
-class binary_expr_ast: public expr_ast {
-    private:
-        char op;
-        std::unique_ptr<expr_ast> lhs, rhs;
+static constexpr keyword keywords[] = {
+    { "def", tok_def },
+    { "extern", tok_extern },
+    { "if", tok_if },
+    { "then", tok_then },
+    { "else", tok_else },
+};
 
-    public:
-        binary_expr_ast(char op, std::unique_ptr<expr_ast> lhs,
-                std::unique_ptr<expr_ast> rhs) :
-            op (op), lhs(std::move(lhs)), rhs(std::move (rhs)) {}
+// Keyword recognition uses a perfect hash over the length and the first and
+// last characters of an identifier. make_keyword_table() searches for a seed
+// that gives every keyword its own slot, so a lookup is one hash, one load and
+// one compare.
+static constexpr size_t keyword_slot_count = 64;
+
+static constexpr size_t keyword_hash(std::string_view s, unsigned seed) {
+    unsigned h = seed ^ static_cast<unsigned>(s.size());
+    h = h * 31 + static_cast<unsigned char>(s.front());
+    h = h * 31 + static_cast<unsigned char>(s.back());
+    return (h ^ (h >> 7)) & (keyword_slot_count - 1);
+}
+
+struct keyword_table {
+    unsigned seed;
+    keyword slots[keyword_slot_count];
 };
 
+static constexpr keyword_table make_keyword_table() {
+    for (unsigned seed = 0; seed < 1024; ++seed) {
+        keyword_table table = { seed, {} };
+        bool perfect = true;
+        for (const keyword &kw : keywords) {
+            keyword &slot = table.slots[keyword_hash(kw.spelling, seed)];
+            if (!slot.spelling.empty()) {
+                perfect = false;
+                break;
+            }
+            slot = kw;
+        }
+        if (perfect)
+            return table;
+    }
+    return { ~0u, {} };
+}
+
+static constexpr keyword_table keyword_lookup = make_keyword_table();
+static_assert(keyword_lookup.seed != ~0u, "no perfect hash seed for the keyword table");
 
-// call_expr_ast = expression class for function calls
-class call_expr_ast: public expr_ast {
-    private:
-        std::string callee;
-        std::vector<std::unique_ptr<expr_ast>> args;
+// identifier_token - the keyword token for id, or tok_identifier
+static inline int identifier_token(std::string_view id) {
+    const keyword &slot = keyword_lookup.slots[keyword_hash(id, keyword_lookup.seed)];
+    return slot.spelling == id ? slot.kind : tok_identifier;
+}
 
-    public:
-        call_expr_ast (const std::string &callee,
-                std::vector<std::unique_ptr<expr_ast>> args) :
-            callee(callee), args(std::move(args)) {};
+// Character classification for the lexer. Kaleidoscope source is ASCII, so
+// a fixed table replaces the locale-aware <cctype> calls.
+enum char_class : uint8_t {
+    cc_space = 1 << 0,
+    cc_alpha = 1 << 1,
+    cc_digit = 1 << 2,
 };
 
-// prototype_ast - base class for function prototype, 
-// which is basically a function name and it's argument names
-class prototype_ast {
-    private:
-        std::string name;
-        std::vector<std::string> args;
+struct char_class_table {
+    uint8_t bits[256];
+};
 
-    public:
-        prototype_ast(const std::string name,
-                std::vector<std::string> args) :
-            name(name), args(std::move(args)) {};
+static constexpr char_class_table make_char_class_table() {
+    char_class_table table = {};
+    for (int c = 0; c < 256; ++c) {
+        if (c == ' ' || (c >= '\t' && c <= '\r'))
+            table.bits[c] |= cc_space;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+            table.bits[c] |= cc_alpha;
+        if (c >= '0' && c <= '9')
+            table.bits[c] |= cc_digit;
+    }
+    return table;
+}
 
-        const std::string& get_name() const {
-            return name;
-        }
+static constexpr char_class_table char_classes = make_char_class_table();
+
+// has_class - true if c (a character or EOF) belongs to any of the classes
+static inline bool has_class(int c, uint8_t classes) {
+    return c >= 0 && (char_classes.bits[c] & classes);
+}
+
+// Run scanners. Each one returns the first position in [p, end) holding a
+// character that does not belong to the run, or end. The SSE2 and AVX2
+// variants classify 16 or 32 characters per step; the best one the CPU
+// supports is picked once at startup.
+//
+// A run class provides the scalar test and the vector forms of it, where
+// the vector forms set a lane to 0xff for every character inside the run.
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define KALEIDOSCOPE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if KALEIDOSCOPE_X86_SIMD
+// in_range_sse2 - lanes of v within [lo, hi], compared as unsigned
+static inline __m128i in_range_sse2(__m128i v, char lo, char hi) {
+    __m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(hi - lo)), offset);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i in_range_avx2(__m256i v, char lo, char hi) {
+    __m256i offset = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(hi - lo)), offset);
+}
+#endif
+
+// whitespace
+struct space_run {
+    static bool scalar(unsigned char c) {
+        return char_classes.bits[c] & cc_space;
+    }
+#if KALEIDOSCOPE_X86_SIMD
+    static __m128i sse2(__m128i v) {
+        return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                in_range_sse2(v, '\t', '\r'));
+    }
+    __attribute__((target("avx2")))
+    static __m256i avx2(__m256i v) {
+        return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                in_range_avx2(v, '\t', '\r'));
+    }
+#endif
 };
 
-// function_ast - class for a function definition itself
-class function_ast {
-    private:
-        std::unique_ptr<prototype_ast> proto;
-        std::unique_ptr<expr_ast> body;
+// the tail of an identifier: letters and digits
+struct identifier_run {
+    static bool scalar(unsigned char c) {
+        return char_classes.bits[c] & (cc_alpha | cc_digit);
+    }
+#if KALEIDOSCOPE_X86_SIMD
+    static __m128i sse2(__m128i v) {
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        return _mm_or_si128(in_range_sse2(v, '0', '9'), in_range_sse2(lower, 'a', 'z'));
+    }
+    __attribute__((target("avx2")))
+    static __m256i avx2(__m256i v) {
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        return _mm256_or_si256(in_range_avx2(v, '0', '9'), in_range_avx2(lower, 'a', 'z'));
+    }
+#endif
+};
 
-    public:
-        function_ast(std::unique_ptr<prototype_ast> proto,
-                std::unique_ptr<expr_ast> body): 
-            proto(std::move(proto)), body(std::move(body)) {};
+// decimal digits
+struct digit_run {
+    static bool scalar(unsigned char c) {
+        return char_classes.bits[c] & cc_digit;
+    }
+#if KALEIDOSCOPE_X86_SIMD
+    static __m128i sse2(__m128i v) {
+        return in_range_sse2(v, '0', '9');
+    }
+    __attribute__((target("avx2")))
+    static __m256i avx2(__m256i v) {
+        return in_range_avx2(v, '0', '9');
+    }
+#endif
 };
 
-// Simple token buffer. curr_token is a token parser looking at.
-// get_next_token reads another token from lexer and updates curr_token.
-// It allows to look one token ahead at what the lexer returns.
-static int current_token;
+// comment text: everything up to the end of the line
+struct comment_run {
+    static bool scalar(unsigned char c) {
+        return c != '\n' && c != '\r';
+    }
+#if KALEIDOSCOPE_X86_SIMD
+    static __m128i sse2(__m128i v) {
+        __m128i eol = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+        return _mm_xor_si128(eol, _mm_set1_epi8(-1));
+    }
+    __attribute__((target("avx2")))
+    static __m256i avx2(__m256i v) {
+        __m256i eol = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        return _mm256_xor_si256(eol, _mm256_set1_epi8(-1));
+    }
+#endif
+};
 
-static int get_next_token() {
-    return current_token = get_token();
+template <typename Run>
+static const char *scan_scalar(const char *p, const char *end) {
+    while (p != end && Run::scalar(static_cast<unsigned char>(*p)))
+        ++p;
+    return p;
 }
 
-// Error handling functions
-std::unique_ptr<expr_ast> log_error(const std::string& str) {
-    std::cerr << "log_error: " << str << "\n";
-    return nullptr;
+#if KALEIDOSCOPE_X86_SIMD
+template <typename Run>
+static const char *scan_sse2(const char *p, const char *end) {
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        unsigned outside = ~_mm_movemask_epi8(Run::sse2(v)) & 0xffff;
+        if (outside)
+            return p + __builtin_ctz(outside);
+        p += 16;
+    }
+    return scan_scalar<Run>(p, end);
 }
 
-std::unique_ptr<prototype_ast> log_error_proto(const std::string& str) {
-    log_error(str);
-    return nullptr;
+template <typename Run>
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end) {
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        unsigned outside = ~static_cast<unsigned>(_mm256_movemask_epi8(Run::avx2(v)));
+        if (outside)
+            return p + __builtin_ctz(outside);
+        p += 32;
+    }
+    return scan_sse2<Run>(p, end);
 }
+#endif
 
-// numberexpr ::= number
-static std::unique_ptr<expr_ast> parse_number_expr() {
-    auto result = std::make_unique<number_expr_ast>(numeric_value);
-    get_next_token();
-    return std::move(result);
-}
+typedef const char *(*scan_fn)(const char *p, const char *end);
 
-// parenexpr ::= '(' expression ')'
-static std::unique_ptr<expr_ast> parse_paren_expr() {
-    get_next_token(); // consume '('
-    auto v = parse_expression();
-    if (!v)
-        return nullptr;
+// scan_kernels - the run scanners used by the lexer
+struct scan_kernels {
+    const char *name;
+    scan_fn space;
+    scan_fn identifier;
+    scan_fn digits;
+    scan_fn comment;
+};
 
-    if (current_token != ')')
-        return log_error("expected ')', got " + std::to_string(current_token) + " instead.");
-    get_next_token(); // consume ')'
-    return v;
+static scan_kernels select_scan_kernels() {
+#if KALEIDOSCOPE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return { "avx2", scan_avx2<space_run>, scan_avx2<identifier_run>,
+            scan_avx2<digit_run>, scan_avx2<comment_run> };
+    return { "sse2", scan_sse2<space_run>, scan_sse2<identifier_run>,
+        scan_sse2<digit_run>, scan_sse2<comment_run> };
+#else
+    return { "scalar", scan_scalar<space_run>, scan_scalar<identifier_run>,
+        scan_scalar<digit_run>, scan_scalar<comment_run> };
+#endif
 }
 
-// identifiere_xpr
-//   ::= identifier
-//   ::= identifier '(' expression* ')'
-static std::unique_ptr<expr_ast> parse_identifier_expr() {
-    std::string id_name = identifier_str;
+static const scan_kernels scanners = select_scan_kernels();
 
-    get_next_token(); // consume identifier
+// symbol - an interned identifier, see symbol_table
+typedef uint32_t symbol;
 
-    if (current_token != '(') // simple variable ref
-        return std::make_unique<variable_expr_ast>(id_name);
+// symbol_table - interns identifier text, giving each distinct name a dense
+// 32-bit symbol. The lexer interns every identifier it reads, so the parser
+// and the AST compare and look up names as integers. One table is shared by
+// everything compiled in a session. Names are stored in blocks that never
+// move, so a view returned by name() stays valid as the table grows.
+class symbol_table {
+    private:
+        static constexpr size_t block_size = 1 << 16;
+        static constexpr uint32_t empty_slot = ~0u;
 
-    // Call
-    get_next_token(); // consume '('
-    std::vector<std::unique_ptr<expr_ast>> args;
-    if (current_token != ')') {
-        while (true) {
-            if (auto arg = parse_expression())
-                args.push_back(std::move(arg));
-            else
-                return nullptr;
+        struct entry {
+            const char *text;
+            uint32_t length;
+            uint32_t hash;
+        };
 
-            if (current_token == ')')
-                break;
+        std::vector<entry> entries;    // indexed by symbol
+        std::vector<uint32_t> slots;   // open addressing table of symbols
+        std::vector<std::unique_ptr<char[]>> blocks;
+        char *block_cur = nullptr;
+        char *block_end = nullptr;
 
-            if (current_token != ',')
-                return log_error("Expected ')' of ',' in argument list, got " + 
-                        std::to_string(current_token) + " instead.");
-            get_next_token();
+        static uint32_t hash(std::string_view text) {
+            // FNV-1a
+            uint32_t h = 2166136261u;
+            for (char c : text)
+                h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+            return h;
+        }
+
+        const char *store(std::string_view text) {
+            if (static_cast<size_t>(block_end - block_cur) < text.size()) {
+                size_t size = std::max(block_size, text.size());
+                blocks.emplace_back(new char[size]);
+                block_cur = blocks.back().get();
+                block_end = block_cur + size;
+            }
+            char *stored = block_cur;
+            if (!text.empty())
+                memcpy(stored, text.data(), text.size());
+            block_cur += text.size();
+            return stored;
+        }
+
+        void grow() {
+            std::vector<uint32_t> old_slots(slots.size() * 2, empty_slot);
+            old_slots.swap(slots);
+            size_t mask = slots.size() - 1;
+            for (uint32_t sym : old_slots) {
+                if (sym == empty_slot)
+                    continue;
+                size_t i = entries[sym].hash & mask;
+                while (slots[i] != empty_slot)
+                    i = (i + 1) & mask;
+                slots[i] = sym;
+            }
+        }
+
+    public:
+        // the name of top-level expressions' anonymous functions
+        static constexpr symbol anonymous = 0;
+
+        symbol_table(): slots(1024, empty_slot) {
+            intern("");
+        }
+
+        symbol_table(const symbol_table&) = delete;
+        symbol_table& operator=(const symbol_table&) = delete;
+
+        // intern - the symbol for text, adding it if it is new
+        symbol intern(std::string_view text) {
+            uint32_t h = hash(text);
+            size_t mask = slots.size() - 1;
+            for (size_t i = h & mask; ; i = (i + 1) & mask) {
+                uint32_t sym = slots[i];
+                if (sym == empty_slot) {
+                    sym = entries.size();
+                    entries.push_back({ store(text), static_cast<uint32_t>(text.size()), h });
+                    slots[i] = sym;
+                    // keep the load factor at or below one half
+                    if (entries.size() * 2 > slots.size())
+                        grow();
+                    return sym;
+                }
+                const entry &e = entries[sym];
+                if (e.hash == h && name(sym) == text)
+                    return sym;
+            }
+        }
+
+        std::string_view name(symbol sym) const {
+            return std::string_view(entries[sym].text, entries[sym].length);
         }
+
+        size_t size() const {
+            return entries.size();
+        }
+};
+
+// token_stream - lexed tokens stored as parallel arrays, one entry per token.
+// The parser indexes into it, so tokens can be looked at in any order and
+// lexing can run ahead of parsing, up to the whole input at once.
+struct token_stream {
+    std::vector<int16_t> kinds;     // token kind, see enum token
+    std::vector<uint32_t> offsets;  // source offset of the token text
+    std::vector<uint32_t> lengths;  // length of the token text
+    std::vector<uint32_t> literals; // index into numbers for tok_number,
+                                    // the symbol for tok_identifier
+    std::vector<double> numbers;
+
+    size_t size() const {
+        return kinds.size();
     }
 
-    get_next_token(); // consume ')'
+    bool ends_with_eof() const {
+        return !kinds.empty() && kinds.back() == tok_eof;
+    }
 
-    return std::make_unique<call_expr_ast>(id_name, std::move(args));
-}
+    void reserve(size_t count) {
+        kinds.reserve(count);
+        offsets.reserve(count);
+        lengths.reserve(count);
+        literals.reserve(count);
+    }
 
-// primary_expr
-//   ::= identifier_expr
-//   ::= number_expr
-//   ::= paren_expr
-static std::unique_ptr<expr_ast> parse_primary() {
-    switch (current_token) {
-        default:
-            return log_error("Expected expression, got " + 
-                    std::to_string(current_token) + " instead");
-        case tok_identifier:
-            return parse_identifier_expr();
-        case tok_number:
-            return parse_number_expr();
-        case '(':
-            return parse_paren_expr();
+    void push(int kind, source_span span, uint32_t literal) {
+        kinds.push_back(kind);
+        offsets.push_back(span.offset);
+        lengths.push_back(span.length);
+        literals.push_back(literal);
+    }
+
+    void push_number(source_span span, double number) {
+        push(tok_number, span, numbers.size());
+        numbers.push_back(number);
+    }
+
+    void pop_back() {
+        if (kinds.back() == tok_number)
+            numbers.pop_back();
+        kinds.pop_back();
+        offsets.pop_back();
+        lengths.pop_back();
+        literals.pop_back();
+    }
+
+    void resize(size_t count, size_t number_count) {
+        kinds.resize(count);
+        offsets.resize(count);
+        lengths.resize(count);
+        literals.resize(count);
+        numbers.resize(number_count);
+    }
+
+    void swap(token_stream &other) {
+        kinds.swap(other.kinds);
+        offsets.swap(other.offsets);
+        lengths.swap(other.lengths);
+        literals.swap(other.literals);
+        numbers.swap(other.numbers);
+    }
+
+    source_span span(size_t i) const {
+        return { offsets[i], lengths[i] };
+    }
+
+    double number(size_t i) const {
+        return numbers[literals[i]];
     }
-}
 
-// biop_precedence - precedence for each binary operator defined
-static std::map<char, int> binop_precedence = 
-{
-    { '<', 10 },
-    { '>', 10 },
-    { '+', 20 },
-    { '-', 20 },
-    { '*', 40 },
-    { '/', 40 }
+    symbol identifier(size_t i) const {
+        return literals[i];
+    }
 };
 
-// get_token_precedence - get the precedence of the pending binary operator
-static int get_token_precedence() {
-    if (!isascii(current_token)) 
-        return -1;
+// lexer - turns a source buffer into tokens. All lexing state lives here,
+// so independent lexers can run on separate threads.
+class lexer {
+    private:
+        source_buffer &source;
+        symbol_table &symbols;
+        const char *cur; // next character to be lexed
+        const char *end; // end of the characters read so far
+        bool bounded;    // lexing a slice of the source, never refill
+        std::ostream &errors;
 
-    int token_precedence = binop_precedence[current_token];
-    if (token_precedence <= 0)
-        return -1;
+        source_span token_span = { 0, 0 }; // source text of the last token
+        double numeric_value = 0;          // filled in if tok_number
+        symbol identifier_symbol = 0;      // filled in if tok_identifier
 
-    return token_precedence;
-}
+        bool refill();
+        inline int peek_char();
+        inline void skip_run(scan_fn scan);
 
+        uint32_t offset() const {
+            return static_cast<uint32_t>(cur - source.data());
+        }
+
+    public:
+        lexer(source_buffer &source, symbol_table &symbols, std::ostream &errors = std::cerr) :
+            source(source), symbols(symbols), cur(source.data()),
+            end(source.data() + source.size()), bounded(false), errors(errors) {}
+
+        // lexer over [begin, end) of a source that has been read completely
+        lexer(source_buffer &source, symbol_table &symbols, uint32_t begin, uint32_t end,
+                std::ostream &errors) :
+            source(source), symbols(symbols), cur(source.data() + begin),
+            end(source.data() + end), bounded(true), errors(errors) {}
 
-// binop_rhs
-//   ::= ('+' primary) *
-static std::unique_ptr<expr_ast> parse_binop_rhs(int expr_precedence,
-        std::unique_ptr<expr_ast> left_hand_side) {
-    // if this is a binop, find its precedence.
-    while(true) {
-        int token_precedence = get_token_precedence();
+        int get_token();
 
-        // if this is a binop that binds at lease as tightly as the current binop,
-        // consume it, otherwise we are done.
-        if (token_precedence < expr_precedence) {
-            return left_hand_side;
+        // lex_next - lex one more token onto the end of stream
+        void lex_next(token_stream &stream) {
+            int kind = get_token();
+            if (kind == tok_number)
+                stream.push_number(token_span, numeric_value);
+            else
+                stream.push(kind, token_span, kind == tok_identifier ? identifier_symbol : 0);
         }
 
-        // ok, we know it's binop
-        int binary_op = current_token;
-        get_next_token();  // consume binop
+        void lex_all(token_stream &stream);
 
-        // parse the primary expression after the binary operator.
-        auto right_hand_side = parse_primary();
-        if (!right_hand_side) 
-            return nullptr;
+        const source_buffer &buffer() const {
+            return source;
+        }
 
-        // if binop binds less tightly with rhs than the operator after rhs,
-        // let the pending operator take rhs and its lhs.
-        int next_precedence = get_token_precedence();
-        if (token_precedence < next_precedence) {
-            right_hand_side = parse_binop_rhs(token_precedence + 1, 
-                    std::move(right_hand_side));
-            if (!right_hand_side) {
-                return nullptr;
-            }
+        symbol_table &symbol_names() const {
+            return symbols;
         }
+};
 
-        // merge lhs/rhs
-        left_hand_side = std::make_unique<binary_expr_ast>(binary_op, 
-                std::move(left_hand_side), 
-                std::move(right_hand_side));
-        
-        
-    } // loop around to the top of the while loop
+// refill - pull more input into the source buffer and re-point
+// the cursor at it. Returns false at end of input.
+bool lexer::refill() {
+    if (bounded)
+        return false;
+    size_t cur_offset = cur - source.data();
+    if (!source.refill())
+        return false;
+    cur = source.data() + cur_offset;
+    end = source.data() + source.size();
+    return true;
 }
 
-// expression
-//   ::= primary binoprhs
-static std::unique_ptr<expr_ast> parse_expression() {
-    auto lhs = parse_primary();
-    if (!lhs)
-        return nullptr;
+// peek_char - return the character under the cursor without consuming it,
+// or EOF at end of input.
+inline int lexer::peek_char() {
+    if (cur == end && !refill())
+        return EOF;
+    return static_cast<unsigned char>(*cur);
+}
 
-    return parse_binop_rhs(0, std::move(lhs));
+// skip_run - move the cursor past a run of characters accepted by scan,
+// refilling the source buffer if the run reaches the end of what was read.
+inline void lexer::skip_run(scan_fn scan) {
+    while (true) {
+        cur = scan(cur, end);
+        if (cur != end || !refill())
+            return;
+    }
 }
 
-// prototype
-//   ::= id '(' id* ')'
-static std::unique_ptr<prototype_ast> parse_prototype() {
-    if (current_token != tok_identifier)
-        return log_error_proto("Expected function name in prototype, got " +
-                std::to_string(current_token) + " instead");
+// gettok - Return the next token from the source buffer.
+// Read a sequence of alphanumerical characters and 
+// return corresponding token type
+int lexer::get_token() {
+    int c;
 
-    std::string fn_name = identifier_str;
-    get_next_token();
-    if(current_token != '(') 
-        return log_error_proto("Expected '(' in prototype, got " + 
-                std::to_string(current_token) + " instead.");
+    // Skip any whitespace, and comments till the end of line
+    while (true) {
+        skip_run(scanners.space);
+        c = peek_char();
+        if (c != '#')
+            break;
+        ++cur;
+        skip_run(scanners.comment);
+    }
+    uint32_t start = offset();
 
-    // Read the list of argument names
-    std::vector<std::string> arg_names;
-    while (get_next_token() == tok_identifier) 
-        arg_names.push_back(identifier_str);
-    if (current_token != ')')
-        return log_error_proto("Expected ')' in prototype, got " +
-                std::to_string(current_token) + " instead.");
+    // Handle a sequence of alphabetic characters as a known identifier or a string
+    if (has_class(c, cc_alpha)) { 
+        ++cur;
+        skip_run(scanners.identifier);
+        token_span = { start, offset() - start };
 
-    // success
-    get_next_token(); // consume ')'
-    
-    return std::make_unique<prototype_ast>(fn_name, std::move(arg_names));
+        std::string_view identifier = source.text(token_span);
+        int kind = identifier_token(identifier);
+        if (kind == tok_identifier)
+            identifier_symbol = symbols.intern(identifier);
+        return kind;
+    }
 
-}
+    // Handle a sequence of characters as a floating-point numeric value:
+    //   number ::= digit+ ('.' digit*)? | '.' digit+
+    // The whole run of letters, digits and dots is taken as the literal, so
+    // 1.2.3 or 12ab is reported as one malformed number.
+    if (has_class(c, cc_digit) || c == '.') {
+        do {
+            if (c == '.')
+                ++cur;
+            skip_run(scanners.identifier);
+            c = peek_char();
+        } while (c == '.');
 
-// definition 
-//   ::= 'def' prototype expression
-static std::unique_ptr<function_ast> parse_definition() {
-    get_next_token(); // consume 'def'
-    auto proto = parse_prototype();
-    if (!proto)
-        return nullptr;
+        token_span = { start, offset() - start };
+        std::string_view literal = source.text(token_span);
+        const char *literal_end = literal.data() + literal.size();
+        auto [parsed_end, error] = std::from_chars(literal.data(), literal_end,
+                numeric_value, std::chars_format::fixed);
+        if (error == std::errc() && parsed_end == literal_end)
+            return tok_number;
+
+        std::string message = error == std::errc::result_out_of_range
+            ? "numeric literal out of range" : "malformed numeric literal";
+        report_error(errors, source, start, message + " '" + std::string(literal) + "'");
+        return tok_error;
+    }
+
+    // Handle EOF character
+    if (c == EOF) {
+        token_span = { start, 0 };
+        return tok_eof;
+    }
+
+    // Handle other kinds of characters as plain ASCII characters
+    ++cur;
+    token_span = { start, 1 };
+    return c;
 
-    if (auto expr = parse_expression())
-        return std::make_unique<function_ast>(std::move(proto), std::move(expr));
-    return nullptr;
 }
 
-// external
-//   ::= 'extern' prototype
-static std::unique_ptr<prototype_ast> parse_extern() {
-    get_next_token(); // consume 'extern'
-    return parse_prototype();
+// lex_all - lex the rest of the source into stream, up to and including tok_eof
+void lexer::lex_all(token_stream &stream) {
+    // a rough guess of one token per five bytes saves most regrowth
+    stream.reserve(stream.size() + (end - cur) / 5 + 1);
+    while (!stream.ends_with_eof())
+        lex_next(stream);
 }
 
+// lex_parallel - lex a completely read source on up to thread_count threads.
+// The source is cut into chunks just after a newline. No token spans a line
+// and a '#' comment always ends at one, so every chunk starts in the same
+// state as the lexer would be in at that point and no token straddles two
+// chunks. Worker threads take chunks in turn and lex each into its own stream
+// and symbol table. The chunk tables are then merged into symbols in chunk
+// order, and the streams copied in order into one with their identifiers
+// renumbered.
+static void lex_parallel(source_buffer &source, symbol_table &symbols, token_stream &stream,
+        unsigned thread_count) {
+    // chunks smaller than this cost more to schedule than to lex
+    const size_t min_chunk_size = 1 << 20;
+    const char *data = source.data();
+    size_t size = source.size();
 
-// toplevel expression
-//  ::= expression
-static std::unique_ptr<function_ast> parse_top_level_expr() {
-    if (auto expr = parse_expression()) {
-        // make an anonymous proto
-        auto proto = std::make_unique<prototype_ast>("", std::vector<std::string>());
-        return std::make_unique<function_ast>(std::move(proto), std::move(expr));
+    std::vector<uint32_t> bounds = { 0 };
+    size_t chunk_size = std::max(min_chunk_size, size / (thread_count * 4) + 1);
+    while (size - bounds.back() > chunk_size) {
+        const char *cut = data + bounds.back() + chunk_size;
+        const void *eol = memchr(cut, '\n', data + size - cut);
+        if (!eol)
+            break;
+        bounds.push_back(static_cast<const char *>(eol) + 1 - data);
     }
-    return nullptr;
+    bounds.push_back(size);
+
+    size_t chunk_count = bounds.size() - 1;
+    std::vector<token_stream> chunks(chunk_count);
+    std::vector<std::unique_ptr<symbol_table>> chunk_symbols(chunk_count);
+    std::vector<std::ostringstream> chunk_errors(chunk_count);
+
+    // run_workers - run task(i) for every chunk index i on the worker threads
+    auto run_workers = [&](auto task) {
+        std::atomic<size_t> next_chunk(0);
+        auto worker = [&]() {
+            for (size_t i; (i = next_chunk++) < chunk_count; )
+                task(i);
+        };
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < std::min<size_t>(thread_count, chunk_count); ++t)
+            threads.emplace_back(worker);
+        worker();
+        for (std::thread &thread : threads)
+            thread.join();
+    };
+
+    run_workers([&](size_t i) {
+        chunk_symbols[i] = std::make_unique<symbol_table>();
+        lexer chunk_lexer(source, *chunk_symbols[i], bounds[i], bounds[i + 1], chunk_errors[i]);
+        chunk_lexer.lex_all(chunks[i]);
+        // only the last chunk ends the input
+        if (i + 1 != chunk_count)
+            chunks[i].pop_back();
+    });
+
+    // map each chunk's symbols to the shared table
+    std::vector<std::vector<symbol>> symbol_map(chunk_count);
+    for (size_t i = 0; i < chunk_count; ++i) {
+        const symbol_table &local = *chunk_symbols[i];
+        symbol_map[i].resize(local.size());
+        for (symbol sym = 0; sym < local.size(); ++sym)
+            symbol_map[i][sym] = symbols.intern(local.name(sym));
+    }
+
+    // lay the chunks out one after another, then copy them in parallel
+    std::vector<size_t> token_base(chunk_count + 1, stream.size());
+    std::vector<size_t> number_base(chunk_count + 1, stream.numbers.size());
+    for (size_t i = 0; i < chunk_count; ++i) {
+        token_base[i + 1] = token_base[i] + chunks[i].size();
+        number_base[i + 1] = number_base[i] + chunks[i].numbers.size();
+    }
+    stream.resize(token_base[chunk_count], number_base[chunk_count]);
+
+    run_workers([&](size_t i) {
+        const token_stream &chunk = chunks[i];
+        size_t at = token_base[i];
+        std::copy(chunk.kinds.begin(), chunk.kinds.end(), stream.kinds.begin() + at);
+        std::copy(chunk.offsets.begin(), chunk.offsets.end(), stream.offsets.begin() + at);
+        std::copy(chunk.lengths.begin(), chunk.lengths.end(), stream.lengths.begin() + at);
+        std::copy(chunk.numbers.begin(), chunk.numbers.end(),
+                stream.numbers.begin() + number_base[i]);
+        for (size_t t = 0; t < chunk.size(); ++t) {
+            uint32_t literal = chunk.literals[t];
+            if (chunk.kinds[t] == tok_number)
+                literal += number_base[i];
+            else if (chunk.kinds[t] == tok_identifier)
+                literal = symbol_map[i][literal];
+            stream.literals[at + t] = literal;
+        }
+        token_stream().swap(chunks[i]);
+        chunk_symbols[i].reset();
+    });
+
+    // report lexing errors in source order
+    for (const std::ostringstream &errors : chunk_errors)
+        std::cerr << errors.str();
 }
 
-int main(int argc, char **argv) {
-    while (true) {
-        fprintf(stderr, "ready> ");
-        switch(current_token) {
-            case tok_eof:
-                return 0;
-            case ';': // ignore top_level semicolons
-                get_next_token();
-                break;
-            case tok_def:
-                handle_definition();
-                break;
-            case tok_extern:
-                handle_extern();
-                break;
-            default:
-                handle_top_level_expr();
-                break;
+// small_vector - a growable list whose first N elements are stored inline.
+// Lists that stay within N never touch the heap; longer ones move to a heap
+// buffer that grows by doubling. Only used for trivially copyable elements.
+// Prototypes collect their parameters in one; call arguments, which nest,
+// collect on the parser's call_args stack instead.
+template <typename T, size_t N>
+class small_vector {
+    private:
+        static_assert(std::is_trivially_copyable<T>::value,
+                "small_vector moves its elements bytewise");
+
+        T *items;
+        size_t count = 0;
+        size_t capacity = N;
+        T inline_items[N];
+
+        bool is_inline() const {
+            return items == inline_items;
+        }
+
+        void grow() {
+            size_t new_capacity = capacity * 2;
+            T *grown = static_cast<T *>(malloc(sizeof(T) * new_capacity));
+            if (!grown)
+                throw std::bad_alloc();
+            memcpy(grown, items, sizeof(T) * count);
+            if (!is_inline())
+                free(items);
+            items = grown;
+            capacity = new_capacity;
+        }
+
+    public:
+        small_vector(): items(inline_items) {}
+        small_vector(const small_vector&) = delete;
+        small_vector& operator=(const small_vector&) = delete;
+
+        ~small_vector() {
+            if (!is_inline())
+                free(items);
+        }
+
+        void push_back(const T &item) {
+            if (count == capacity)
+                grow();
+            items[count++] = item;
+        }
+
+        const T *data() const {
+            return items;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        const T *begin() const {
+            return items;
+        }
+
+        const T *end() const {
+            return items + count;
+        }
+
+        const T &operator[](size_t i) const {
+            return items[i];
+        }
+};
+
+// AST Parser goes here
+//
+// The AST is flat: each kind of node lives in its own contiguous array inside
+// an ast_pool, and nodes refer to their children by 32-bit expr_refs rather
+// than pointers. A function_ast owns the pool holding all of its nodes, so
+// walking a tree touches a few dense arrays and freeing it frees those arrays.
+
+// expr_kind - the kind of an expression node
+enum class expr_kind : uint8_t {
+    number,
+    variable,
+    binary,
+    call,
+    conditional,
+};
+
+// expr_ref - reference to an expression node: the node kind tag in the top
+// bits and the index into that kind's array in the rest. A default constructed
+// expr_ref refers to nothing and tests false.
+class expr_ref {
+    private:
+        static constexpr uint32_t index_bits = 28;
+        uint32_t bits = ~0u;
+
+    public:
+        static constexpr uint32_t max_index = (1u << index_bits) - 2;
+
+        expr_ref() = default;
+        expr_ref(expr_kind kind, uint32_t index) :
+            bits(static_cast<uint32_t>(kind) << index_bits | index) {}
+
+        explicit operator bool() const {
+            return bits != ~0u;
+        }
+
+        expr_kind kind() const {
+            return static_cast<expr_kind>(bits >> index_bits);
+        }
+
+        uint32_t index() const {
+            return bits & ((1u << index_bits) - 1);
+        }
+
+        bool operator==(expr_ref other) const {
+            return bits == other.bits;
+        }
+
+        bool operator!=(expr_ref other) const {
+            return bits != other.bits;
+        }
+};
+
+// array_view - a read-only run of elements in one of the pool's arrays
+template <typename T>
+class array_view {
+    private:
+        const T *items;
+        size_t count;
+
+    public:
+        array_view(): items(nullptr), count(0) {}
+        array_view(const T *items, size_t count): items(items), count(count) {}
+
+        const T *begin() const {
+            return items;
+        }
+
+        const T *end() const {
+            return items + count;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        const T &operator[](size_t i) const {
+            return items[i];
+        }
+};
+
+// Every node records the source offset it was parsed from; diagnostics turn
+// it into a line and column through the source buffer's line table.
+
+// number_expr_ast- Expression class for numeric literals like 0, 1.2345
+struct number_expr_ast {
+    static constexpr expr_kind kind = expr_kind::number;
+    uint32_t location;
+    double value;
+};
+
+// variable_expr_ast - Expression class for referencing a variable
+struct variable_expr_ast {
+    static constexpr expr_kind kind = expr_kind::variable;
+    uint32_t location;
+    symbol name;
+};
+
+// binary_expr_ast - expression class for a binary operator
+struct binary_expr_ast {
+    static constexpr expr_kind kind = expr_kind::binary;
+    uint32_t location;
+    char op;
+    expr_ref lhs, rhs;
+};
+
+// call_expr_ast = expression class for function calls. The arguments are
+// arg_count consecutive entries of the pool's argument array.
+struct call_expr_ast {
+    static constexpr expr_kind kind = expr_kind::call;
+    uint32_t location;
+    symbol callee;
+    uint32_t first_arg;
+    uint32_t arg_count;
+};
+
+// if_expr_ast - expression class for if/then/else
+struct if_expr_ast {
+    static constexpr expr_kind kind = expr_kind::conditional;
+    uint32_t location;
+    expr_ref condition, then_expr, else_expr;
+};
+
+// prototype_ast - base class for function prototype, 
+// which is basically a function name and it's argument names.
+// The argument names are arg_count consecutive entries of the pool's
+// parameter array.
+struct prototype_ast {
+    uint32_t location;
+    symbol name;
+    uint32_t first_arg;
+    uint32_t arg_count;
+};
+
+// ast_pool - storage for every node of one function. The parser fills the
+// pool's own arrays; a pool can also be a view of arrays that live elsewhere,
+// such as a mapped AST cache. Nodes are always read through the views.
+class ast_pool {
+    private:
+        std::tuple<std::vector<number_expr_ast>,
+                   std::vector<variable_expr_ast>,
+                   std::vector<binary_expr_ast>,
+                   std::vector<call_expr_ast>,
+                   std::vector<if_expr_ast>> nodes;
+        std::vector<expr_ref> args;   // call arguments
+        std::vector<symbol> params;   // prototype argument names
+
+        std::tuple<array_view<number_expr_ast>,
+                   array_view<variable_expr_ast>,
+                   array_view<binary_expr_ast>,
+                   array_view<call_expr_ast>,
+                   array_view<if_expr_ast>> node_views;
+        array_view<expr_ref> arg_view;
+        array_view<symbol> param_view;
+
+        template <typename T>
+        std::vector<T> &nodes_of() {
+            return std::get<std::vector<T>>(nodes);
+        }
+
+        template <typename T>
+        const std::vector<T> &nodes_of() const {
+            return std::get<std::vector<T>>(nodes);
+        }
+
+        template <typename T>
+        array_view<T> &view_of() {
+            return std::get<array_view<T>>(node_views);
+        }
+
+        template <typename T>
+        static array_view<T> view(const std::vector<T> &items) {
+            return array_view<T>(items.data(), items.size());
+        }
+
+    public:
+        ast_pool() = default;
+        ast_pool(ast_pool &&) = default;
+        ast_pool &operator=(ast_pool &&) = default;
+        // copies would keep viewing the original's arrays
+        ast_pool(const ast_pool &) = delete;
+        ast_pool &operator=(const ast_pool &) = delete;
+
+        // mapped - a pool reading its nodes from arrays it does not own
+        static ast_pool mapped(array_view<number_expr_ast> numbers,
+                array_view<variable_expr_ast> variables, array_view<binary_expr_ast> binaries,
+                array_view<call_expr_ast> calls, array_view<if_expr_ast> conditionals,
+                array_view<expr_ref> args, array_view<symbol> params) {
+            ast_pool pool;
+            pool.node_views = std::make_tuple(numbers, variables, binaries, calls, conditionals);
+            pool.arg_view = args;
+            pool.param_view = params;
+            return pool;
+        }
+
+        // add - append a node, returning a reference to it or a null
+        // reference if the pool for its kind is full
+        template <typename T>
+        expr_ref add(const T &node) {
+            std::vector<T> &pool = nodes_of<T>();
+            if (pool.size() > expr_ref::max_index)
+                return expr_ref();
+            pool.push_back(node);
+            view_of<T>() = view(pool);
+            return expr_ref(T::kind, pool.size() - 1);
+        }
+
+        template <typename T>
+        const T &get(expr_ref ref) const {
+            return std::get<array_view<T>>(node_views)[ref.index()];
+        }
+
+        // all - every node of kind T, in reference index order
+        template <typename T>
+        array_view<T> all() const {
+            return std::get<array_view<T>>(node_views);
+        }
+
+        // add_args - append a call's arguments, returning the first index
+        uint32_t add_args(const expr_ref *refs, size_t count) {
+            uint32_t first = args.size();
+            args.insert(args.end(), refs, refs + count);
+            arg_view = view(args);
+            return first;
+        }
+
+        // discard_args - drop the arguments from index first on, added for a
+        // call that turned out not to be needed
+        void discard_args(uint32_t first) {
+            args.resize(first);
+            arg_view = view(args);
+        }
+
+        array_view<expr_ref> call_args(const call_expr_ast &call) const {
+            return array_view<expr_ref>(arg_view.begin() + call.first_arg, call.arg_count);
+        }
+
+        array_view<expr_ref> all_args() const {
+            return arg_view;
+        }
+
+        // add_params - append a prototype's argument names, returning the first index
+        uint32_t add_params(const symbol *names, size_t count) {
+            uint32_t first = params.size();
+            params.insert(params.end(), names, names + count);
+            param_view = view(params);
+            return first;
+        }
+
+        array_view<symbol> proto_args(const prototype_ast &proto) const {
+            return array_view<symbol>(param_view.begin() + proto.first_arg, proto.arg_count);
+        }
+
+        array_view<symbol> all_params() const {
+            return param_view;
+        }
+
+        // shrink_to_fit - drop the spare capacity of a pool that is complete
+        void shrink_to_fit() {
+            std::apply([](auto&... pools) { (pools.shrink_to_fit(), ...); }, nodes);
+            args.shrink_to_fit();
+            params.shrink_to_fit();
+            node_views = std::make_tuple(view(nodes_of<number_expr_ast>()),
+                    view(nodes_of<variable_expr_ast>()), view(nodes_of<binary_expr_ast>()),
+                    view(nodes_of<call_expr_ast>()), view(nodes_of<if_expr_ast>()));
+            arg_view = view(args);
+            param_view = view(params);
+        }
+
+        // memory_size - bytes of heap used by the pool's own arrays
+        size_t memory_size() const {
+            return sizeof(number_expr_ast) * nodes_of<number_expr_ast>().capacity()
+                + sizeof(variable_expr_ast) * nodes_of<variable_expr_ast>().capacity()
+                + sizeof(binary_expr_ast) * nodes_of<binary_expr_ast>().capacity()
+                + sizeof(call_expr_ast) * nodes_of<call_expr_ast>().capacity()
+                + sizeof(if_expr_ast) * nodes_of<if_expr_ast>().capacity()
+                + sizeof(expr_ref) * args.capacity()
+                + sizeof(symbol) * params.capacity();
+        }
+};
+
+// Node kind tests and casts, in the style of LLVM's isa<>/cast<>/dyn_cast<>.
+// The kind is part of every expr_ref, so a test never touches the node.
+
+// isa - true if ref refers to a node of type T
+template <typename T>
+bool isa(expr_ref ref) {
+    return ref && ref.kind() == T::kind;
+}
+
+// cast - the node ref refers to, which must be a T
+template <typename T>
+const T &cast(const ast_pool &pool, expr_ref ref) {
+    assert(isa<T>(ref) && "cast to the wrong node kind");
+    return pool.get<T>(ref);
+}
+
+// dyn_cast - the node ref refers to if it is a T, otherwise nullptr
+template <typename T>
+const T *dyn_cast(const ast_pool &pool, expr_ref ref) {
+    return isa<T>(ref) ? &pool.get<T>(ref) : nullptr;
+}
+
+// left_spine - append node and the binary operators down its chain of left
+// operands to spine, outermost first. A chain like a + b + c + d is as long
+// as the expression, so passes fold over its spine from the innermost link
+// instead of recursing into every left operand.
+static void left_spine(const ast_pool &pool, const binary_expr_ast &node,
+        std::vector<const binary_expr_ast *> &spine) {
+    const binary_expr_ast *link = &node;
+    spine.push_back(link);
+    while (const binary_expr_ast *inner = dyn_cast<binary_expr_ast>(pool, link->lhs)) {
+        link = inner;
+        spine.push_back(link);
+    }
+}
+
+// stack_floor - the lowest native stack address that a pass recursing over an
+// expression tree, or a run of generated code, may reach: three quarters of
+// the soft stack limit below where the first of them started, leaving the
+// rest for whatever called it and the library code it calls. They all start
+// from the main loop and nest in each other, so one floor bounds them all.
+static uintptr_t stack_floor() {
+    static const uintptr_t floor = [] {
+        uintptr_t budget = uintptr_t(4) << 20;
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+            budget = limit.rlim_cur / 4 * 3;
+        return reinterpret_cast<uintptr_t>(__builtin_frame_address(0)) - budget;
+    }();
+    return floor;
+}
+
+// stack_exhausted - whether the caller is below stack_floor(). --max-depth
+// lets expressions nest deeper than any stack holds, so recursive passes
+// check this at every level and fail the item instead of overflowing.
+static inline bool stack_exhausted() {
+    return reinterpret_cast<uintptr_t>(__builtin_frame_address(0)) < stack_floor();
+}
+
+// expr_visitor - base for passes over expression trees. Derived implements
+//   Result visit_number(const number_expr_ast &)
+//   Result visit_variable(const variable_expr_ast &)
+//   Result visit_binary(const binary_expr_ast &)
+//   Result visit_call(const call_expr_ast &)
+//   Result visit_if(const if_expr_ast &)
+// and calls visit() on the children it wants to walk. visit() dispatches with
+// a switch on the node kind straight to Derived's methods, so there are no
+// virtual calls and the compiler can inline the whole traversal.
+template <typename Derived, typename Result>
+class expr_visitor {
+    protected:
+        const ast_pool &pool;
+
+        // node_index - the index of node among the pool's nodes of its kind,
+        // for passes that keep side tables indexed by node
+        template <typename T>
+        size_t node_index(const T &node) const {
+            return &node - pool.all<T>().begin();
+        }
+
+    public:
+        explicit expr_visitor(const ast_pool &pool): pool(pool) {}
+
+        Result visit(expr_ref ref) {
+            Derived &self = static_cast<Derived &>(*this);
+            switch (ref.kind()) {
+                case expr_kind::number:
+                    return self.visit_number(cast<number_expr_ast>(pool, ref));
+                case expr_kind::variable:
+                    return self.visit_variable(cast<variable_expr_ast>(pool, ref));
+                case expr_kind::binary:
+                    return self.visit_binary(cast<binary_expr_ast>(pool, ref));
+                case expr_kind::call:
+                    return self.visit_call(cast<call_expr_ast>(pool, ref));
+                case expr_kind::conditional:
+                    return self.visit_if(cast<if_expr_ast>(pool, ref));
+            }
+            __builtin_unreachable();
+        }
+};
+
+// node_interner - hash-consing for one pool. intern() returns the existing
+// node when a structurally identical one was added before, so every distinct
+// subexpression is stored once and a function's tree becomes a DAG. Children
+// are interned before their parents, which makes comparing child references
+// enough to compare whole subtrees. Locations take no part in the identity;
+// a shared node keeps the location it was first parsed at.
+class node_interner {
+    private:
+        static constexpr size_t initial_slots = 256;
+
+        struct slot {
+            expr_ref ref;
+            uint32_t hash;
+        };
+
+        std::vector<slot> slots = std::vector<slot>(initial_slots);
+        size_t count = 0;
+
+        static uint32_t mix(uint32_t h, uint32_t value) {
+            // FNV-1a over 32-bit words
+            return (h ^ value) * 16777619u;
+        }
+
+        static uint32_t hash(const ast_pool &, const number_expr_ast &node) {
+            uint64_t bits;
+            memcpy(&bits, &node.value, sizeof bits);
+            return mix(mix(2166136261u, bits), bits >> 32);
+        }
+
+        static uint32_t hash(const ast_pool &, const variable_expr_ast &node) {
+            return mix(2166136261u, node.name);
+        }
+
+        static uint32_t mix(uint32_t h, expr_ref ref) {
+            return mix(mix(h, static_cast<uint32_t>(ref.kind())), ref.index());
+        }
+
+        static uint32_t hash(const ast_pool &, const binary_expr_ast &node) {
+            return mix(mix(mix(2166136261u, node.op), node.lhs), node.rhs);
+        }
+
+        static uint32_t hash(const ast_pool &pool, const call_expr_ast &node) {
+            uint32_t h = mix(mix(2166136261u, node.callee), node.arg_count);
+            for (expr_ref arg : pool.call_args(node))
+                h = mix(h, arg);
+            return h;
+        }
+
+        static uint32_t hash(const ast_pool &, const if_expr_ast &node) {
+            return mix(mix(mix(2166136261u, node.condition), node.then_expr), node.else_expr);
+        }
+
+        static bool equal(const ast_pool &, const number_expr_ast &a, const number_expr_ast &b) {
+            // bitwise, so that 0.0 and -0.0 stay apart
+            return memcmp(&a.value, &b.value, sizeof a.value) == 0;
+        }
+
+        static bool equal(const ast_pool &, const variable_expr_ast &a, const variable_expr_ast &b) {
+            return a.name == b.name;
+        }
+
+        static bool equal(const ast_pool &, const binary_expr_ast &a, const binary_expr_ast &b) {
+            return a.op == b.op && a.lhs == b.lhs && a.rhs == b.rhs;
+        }
+
+        static bool equal(const ast_pool &, const if_expr_ast &a, const if_expr_ast &b) {
+            return a.condition == b.condition && a.then_expr == b.then_expr &&
+                a.else_expr == b.else_expr;
+        }
+
+        static bool equal(const ast_pool &pool, const call_expr_ast &a, const call_expr_ast &b) {
+            if (a.callee != b.callee || a.arg_count != b.arg_count)
+                return false;
+            array_view<expr_ref> a_args = pool.call_args(a), b_args = pool.call_args(b);
+            return std::equal(a_args.begin(), a_args.end(), b_args.begin());
+        }
+
+        void grow() {
+            std::vector<slot> old_slots(slots.size() * 2);
+            old_slots.swap(slots);
+            size_t mask = slots.size() - 1;
+            for (const slot &s : old_slots) {
+                if (!s.ref)
+                    continue;
+                size_t i = s.hash & mask;
+                while (slots[i].ref)
+                    i = (i + 1) & mask;
+                slots[i] = s;
+            }
+        }
+
+    public:
+        // intern - the reference of a node equal to node in pool, adding node
+        // if there is none yet. A null reference means the pool is full.
+        template <typename T>
+        expr_ref intern(ast_pool &pool, const T &node) {
+            uint32_t h = hash(pool, node);
+            size_t mask = slots.size() - 1;
+            size_t i = h & mask;
+            for (; slots[i].ref; i = (i + 1) & mask) {
+                if (slots[i].hash == h && slots[i].ref.kind() == T::kind &&
+                        equal(pool, pool.get<T>(slots[i].ref), node))
+                    return slots[i].ref;
+            }
+            expr_ref ref = pool.add(node);
+            if (!ref)
+                return ref;
+            slots[i] = { ref, h };
+            // keep the load factor at or below one half
+            if (++count * 2 > slots.size())
+                grow();
+            return ref;
+        }
+
+        // clear - forget every node, before interning into a new pool
+        void clear() {
+            if (count == 0)
+                return;
+            if (slots.size() > initial_slots)
+                slots = std::vector<slot>(initial_slots);
+            else
+                std::fill(slots.begin(), slots.end(), slot());
+            count = 0;
+        }
+};
+
+// function_ast - class for a function definition itself, owning the pool
+// its nodes live in. An extern is a function_ast without a body.
+class function_ast {
+    private:
+        ast_pool pool;
+        prototype_ast proto;
+        expr_ref body;
+
+    public:
+        function_ast(ast_pool pool, prototype_ast proto, expr_ref body): 
+            pool(std::move(pool)), proto(proto), body(body) {};
+
+        const ast_pool &nodes() const {
+            return pool;
+        }
+
+        const prototype_ast &get_proto() const {
+            return proto;
+        }
+
+        symbol get_name() const {
+            return proto.name;
+        }
+
+        expr_ref get_body() const {
+            return body;
+        }
+
+        bool is_extern() const {
+            return !body;
+        }
+};
+
+// Error handling functions
+expr_ref log_error(const source_buffer &source, uint32_t offset,
+        const std::string& str) {
+    report_error(std::cerr, source, offset, str);
+    return expr_ref();
+}
+
+bool log_error_proto(const source_buffer &source, uint32_t offset,
+        const std::string& str) {
+    log_error(source, offset, str);
+    return false;
+}
+
+// parser - builds the AST from a token stream. The stream is either lexed up
+// front or, when it runs out, extended on demand by the lexer. All parsing
+// state lives here, so independent parsers can run on separate threads.
+class parser {
+    private:
+        lexer &lex;
+        const source_buffer &source;
+        token_stream &tokens;
+
+        // Token buffer. current_token is a token parser looking at.
+        // get_next_token moves to the next token of the stream and updates
+        // current_token, token_span and numeric_value from it.
+        size_t token_index = 0; // index of the next token to read
+        int current_token = 0;
+        source_span token_span = { 0, 0 };
+        double numeric_value = 0;
+        symbol identifier_symbol = 0;
+
+        // binop_precedence - precedence for each binary operator, indexed by
+        // the operator character; 0 for anything that is not a binary operator.
+        // Only ASCII characters are registered, so the negative token kinds,
+        // which alias to the top of the table, always read 0.
+        std::array<int8_t, 256> binop_precedence = default_binop_precedence();
+
+        static constexpr std::array<int8_t, 256> default_binop_precedence() {
+            std::array<int8_t, 256> table = {};
+            table['<'] = 10;
+            table['>'] = 10;
+            table['+'] = 20;
+            table['-'] = 20;
+            table['*'] = 40;
+            table['/'] = 40;
+            return table;
+        }
+
+        // nodes of the top-level item being parsed
+        ast_pool pool;
+        size_t node_count = 0; // AST nodes built so far
+
+        // hash consing: share structurally identical subexpressions
+        bool hash_consing = false;
+        node_interner interner;
+
+        // make_node - append an expression node to the current pool, or find
+        // an identical one already there when hash consing
+        template <typename T>
+        expr_ref make_node(const T &node) {
+            ++node_count;
+            expr_ref ref = hash_consing ? interner.intern(pool, node) : pool.add(node);
+            if (!ref)
+                return log_error(source, node.location, "function is too large");
+            return ref;
+        }
+
+        // new_pool - start the pool of the next top-level item
+        void new_pool() {
+            pool = ast_pool();
+            interner.clear();
+        }
+
+        // make_function - hand the current pool over to a new function_ast
+        std::unique_ptr<function_ast> make_function(const prototype_ast &proto, expr_ref body) {
+            ++node_count;
+            pool.shrink_to_fit();
+            return std::make_unique<function_ast>(std::move(pool), proto, body);
+        }
+
+        size_t fetch_token(size_t i);
+        int peek_token(size_t ahead);
+        int get_token_precedence();
+
+        // Expression parser state. Nesting is tracked on these stacks instead
+        // of the native one; they are kept between calls to reuse their memory.
+        struct operand {
+            expr_ref ref;
+            uint32_t depth; // nesting below and including ref, see push_operand
+        };
+        struct pending_operator {
+            uint32_t location;
+            char op;
+            int precedence;
+        };
+        enum group_kind { group_paren, group_call, group_if, group_then, group_else };
+        // open_group_state - a '(' or call waiting for its ')', or an if
+        // waiting for the end of its condition, then or else part
+        struct open_group_state {
+            uint32_t location;
+            symbol callee;
+            uint32_t operator_base; // operators below belong to enclosing groups
+            uint32_t arg_base; // first argument of the call in call_args
+            uint32_t arg_depth; // deepest argument or part so far
+            group_kind kind;
+        };
+        enum primary_result { primary_error, primary_operand, primary_group };
+
+        std::vector<operand> operands;
+        std::vector<pending_operator> operators;
+        std::vector<open_group_state> groups;
+        std::vector<expr_ref> call_args; // of all open calls, innermost last
+        uint32_t max_depth = default_max_depth;
+
+        bool too_deep(uint32_t location);
+        bool push_operand(expr_ref ref, uint32_t depth);
+        bool open_group(symbol callee, uint32_t location, group_kind kind);
+        bool close_call();
+        bool close_if();
+        bool reduce(size_t base, int precedence);
+        primary_result parse_primary();
+        expr_ref parse_expression();
+        bool parse_prototype(prototype_ast &proto);
+
+    public:
+        // default_max_depth - deepest expression nesting accepted by default.
+        // The parser itself does not recurse; the passes that do check the
+        // native stack as they go and fail an item nested too deeply for it.
+        static constexpr uint32_t default_max_depth = 10000;
+
+        parser(lexer &lex, token_stream &tokens) :
+            lex(lex), source(lex.buffer()), tokens(tokens) {}
+
+        bool set_binop_precedence(char op, int precedence);
+
+        // set_hash_consing - build each function as a DAG in which identical
+        // subexpressions are one node
+        void set_hash_consing(bool enable) {
+            hash_consing = enable;
+        }
+
+        // set_max_depth - limit on expression nesting, counting both nested
+        // nodes and open parentheses; deeper input is reported as an error
+        void set_max_depth(uint32_t depth) {
+            max_depth = depth;
+        }
+
+        int get_next_token();
+
+        int current() const {
+            return current_token;
+        }
+
+        const source_buffer &buffer() const {
+            return source;
+        }
+
+        const symbol_table &symbol_names() const {
+            return lex.symbol_names();
+        }
+
+        size_t nodes_built() const {
+            return node_count;
+        }
+
+        // options - the settings that shape the trees it builds, as bytes, so
+        // that trees cached under other settings can be told apart
+        std::string options() const {
+            std::string bytes(binop_precedence.begin(), binop_precedence.end());
+            bytes += hash_consing ? '1' : '0';
+            bytes.append(reinterpret_cast<const char *>(&max_depth), sizeof max_depth);
+            return bytes;
+        }
+
+        std::unique_ptr<function_ast> parse_definition();
+        std::unique_ptr<function_ast> parse_extern();
+        std::unique_ptr<function_ast> parse_top_level_expr();
+        bool parse_command(std::string_view &name);
+};
+
+// fetch_token - the index of token i, lexing up to it if needed. Reads past
+// the end of input keep returning the tok_eof token.
+size_t parser::fetch_token(size_t i) {
+    while (i >= tokens.size()) {
+        if (tokens.ends_with_eof())
+            return tokens.size() - 1;
+        lex.lex_next(tokens);
+    }
+    return i;
+}
+
+int parser::get_next_token() {
+    size_t i = fetch_token(token_index++);
+    token_span = tokens.span(i);
+    if (tokens.kinds[i] == tok_number)
+        numeric_value = tokens.number(i);
+    else if (tokens.kinds[i] == tok_identifier)
+        identifier_symbol = tokens.identifier(i);
+    return current_token = tokens.kinds[i];
+}
+
+// peek_token - kind of the token ahead positions after current_token
+int parser::peek_token(size_t ahead) {
+    return tokens.kinds[fetch_token(token_index + ahead - 1)];
+}
+
+// get_token_precedence - get the precedence of the pending binary operator,
+// 0 if current_token is not one
+int parser::get_token_precedence() {
+    return binop_precedence[static_cast<uint8_t>(current_token)];
+}
+
+// set_binop_precedence - define a binary operator, or redefine its precedence.
+// Characters that already mean something to the lexer or parser are rejected.
+bool parser::set_binop_precedence(char op, int precedence) {
+    unsigned char c = static_cast<unsigned char>(op);
+    if (c >= 0x80 || precedence < 1 || precedence > INT8_MAX ||
+            has_class(c, cc_space | cc_alpha | cc_digit) || strchr("(),;#.", c))
+        return false;
+    binop_precedence[c] = static_cast<int8_t>(precedence);
+    return true;
+}
+
+// too_deep - report an expression over the nesting limit and skip the rest of
+// it, so that its remains are not parsed as further top-level items
+bool parser::too_deep(uint32_t location) {
+    log_error(source, location, "expression is nested more than " +
+            std::to_string(max_depth) + " levels deep");
+    while (current_token != ';' && current_token != tok_def &&
+            current_token != tok_extern && current_token != tok_eof)
+        get_next_token();
+    return false;
+}
+
+// push_operand - push a finished subexpression nested depth levels deep. A
+// call, an if and the right operand of a binary operator each nest one level,
+// but a left operand does not: passes fold over chains of left operands, so
+// a + b + c + ... of any length is only two levels deep.
+bool parser::push_operand(expr_ref ref, uint32_t depth) {
+    if (!ref)
+        return false;
+    if (depth > max_depth)
+        return too_deep(token_span.offset);
+    operands.push_back({ ref, depth });
+    return true;
+}
+
+// open_group - start a parenthesized expression, the arguments of a call or
+// the condition of an if
+bool parser::open_group(symbol callee, uint32_t location, group_kind kind) {
+    if (groups.size() >= max_depth)
+        return too_deep(location);
+    groups.push_back({ location, callee, static_cast<uint32_t>(operators.size()),
+            static_cast<uint32_t>(call_args.size()), 0, kind });
+    return true;
+}
+
+// close_call - turn the collected arguments of the innermost call into a node
+bool parser::close_call() {
+    open_group_state group = groups.back();
+    groups.pop_back();
+    uint32_t arg_count = static_cast<uint32_t>(call_args.size() - group.arg_base);
+    uint32_t first_arg = pool.add_args(call_args.data() + group.arg_base, arg_count);
+    call_args.resize(group.arg_base);
+    expr_ref call = make_node(call_expr_ast{ group.location, group.callee, first_arg, arg_count });
+    // an existing identical call already has its own copy of the arguments
+    if (hash_consing && call && cast<call_expr_ast>(pool, call).first_arg != first_arg)
+        pool.discard_args(first_arg);
+    return push_operand(call, group.arg_depth + 1);
+}
+
+// close_if - turn the innermost if, whose condition, then and else parts are
+// the top three operands, into a node
+bool parser::close_if() {
+    open_group_state group = groups.back();
+    groups.pop_back();
+    operand else_part = operands.back();
+    operands.pop_back();
+    operand then_part = operands.back();
+    operands.pop_back();
+    operand condition = operands.back();
+    operands.pop_back();
+    return push_operand(make_node(if_expr_ast{ group.location, condition.ref, then_part.ref,
+                else_part.ref }), std::max(group.arg_depth, else_part.depth) + 1);
+}
+
+// reduce - merge pending operators above base that bind at least as tightly
+// as precedence with their operands
+bool parser::reduce(size_t base, int precedence) {
+    while (operators.size() > base && operators.back().precedence >= precedence) {
+        pending_operator op = operators.back();
+        operators.pop_back();
+        operand rhs = operands.back();
+        operands.pop_back();
+        operand lhs = operands.back();
+        operands.pop_back();
+        if (!push_operand(make_node(binary_expr_ast{ op.location, op.op, lhs.ref, rhs.ref }),
+                std::max(lhs.depth, rhs.depth + 1)))
+            return false;
+    }
+    return true;
+}
+
+// primary
+//   ::= number
+//   ::= identifier
+//   ::= identifier '(' (expression (',' expression)*)? ')'
+//   ::= '(' expression ')'
+//   ::= 'if' expression 'then' expression 'else' expression
+//
+// Pushes a number or variable on the operand stack, or opens a group for a
+// parenthesized expression, call or if whose contents are parsed next.
+parser::primary_result parser::parse_primary() {
+    switch (current_token) {
+        default:
+            log_error(source, token_span.offset,
+                    "Expected expression, got " + 
+                    std::to_string(current_token) + " instead");
+            return primary_error;
+        case tok_error:
+            return primary_error;
+        case tok_number: {
+            expr_ref number = make_node(number_expr_ast{ token_span.offset, numeric_value });
+            get_next_token(); // consume number
+            return push_operand(number, 1) ? primary_operand : primary_error;
+        }
+        case '(':
+            if (!open_group(symbol_table::anonymous, token_span.offset, group_paren))
+                return primary_error;
+            get_next_token(); // consume '('
+            return primary_group;
+        case tok_if:
+            if (!open_group(symbol_table::anonymous, token_span.offset, group_if))
+                return primary_error;
+            get_next_token(); // consume 'if'
+            return primary_group;
+        case tok_identifier:
+            break;
+    }
+
+    uint32_t id_location = token_span.offset;
+    symbol id_name = identifier_symbol;
+
+    if (peek_token(1) != '(') { // simple variable ref
+        get_next_token(); // consume identifier
+        return push_operand(make_node(variable_expr_ast{ id_location, id_name }), 1) ?
+            primary_operand : primary_error;
+    }
+
+    // Call
+    if (!open_group(id_name, id_location, group_call))
+        return primary_error;
+    get_next_token(); // consume identifier
+    get_next_token(); // consume '('
+    if (current_token != ')')
+        return primary_group;
+
+    get_next_token(); // consume ')'
+    return close_call() ? primary_operand : primary_error;
+}
+
+// expression
+//   ::= primary binoprhs
+// binoprhs
+//   ::= (binop primary)*
+//
+// Parsed without recursion: operands and pending binary operators live on
+// explicit stacks, and every '(', call or if opens a group that its ')' or
+// the end of its else part closes, so deep nesting costs heap rather than
+// native stack and is bounded by max_depth.
+expr_ref parser::parse_expression() {
+    size_t operand_base = operands.size();
+    size_t operator_base = operators.size();
+    size_t group_base = groups.size();
+    size_t arg_base = call_args.size();
+    auto fail = [&]() {
+        operands.resize(operand_base);
+        operators.resize(operator_base);
+        groups.resize(group_base);
+        call_args.resize(arg_base);
+        return expr_ref();
+    };
+
+    while (true) {
+        primary_result primary = parse_primary();
+        if (primary == primary_error)
+            return fail();
+        if (primary == primary_group)
+            continue;
+
+        // after an operand: either a binary operator follows, or the
+        // innermost group (or the whole expression) ends here
+        while (true) {
+            size_t base = groups.size() > group_base ? groups.back().operator_base : operator_base;
+            int token_precedence = get_token_precedence();
+            if (token_precedence > 0) {
+                // operators of equal precedence are left associative
+                if (!reduce(base, token_precedence))
+                    return fail();
+                operators.push_back({ token_span.offset, static_cast<char>(current_token),
+                        token_precedence });
+                get_next_token(); // consume binop
+                break;
+            }
+
+            if (!reduce(base, 0))
+                return fail();
+
+            if (groups.size() == group_base) {
+                expr_ref result = operands.back().ref;
+                operands.pop_back();
+                return result;
+            }
+
+            open_group_state &group = groups.back();
+            if (group.kind == group_if || group.kind == group_then) {
+                int expected = group.kind == group_if ? tok_then : tok_else;
+                if (current_token != expected) {
+                    log_error(source, token_span.offset, std::string("expected '") +
+                            (expected == tok_then ? "then" : "else") + "', got " +
+                            std::to_string(current_token) + " instead.");
+                    return fail();
+                }
+                // the finished part stays on the stack until the else part ends
+                group.arg_depth = std::max(group.arg_depth, operands.back().depth);
+                group.kind = group.kind == group_if ? group_then : group_else;
+                get_next_token(); // consume 'then' or 'else'
+                break;
+            }
+
+            if (group.kind == group_else) {
+                if (!close_if())
+                    return fail();
+                continue;
+            }
+
+            if (group.kind == group_paren) {
+                if (current_token != ')') {
+                    log_error(source, token_span.offset,
+                            "expected ')', got " + std::to_string(current_token) + " instead.");
+                    return fail();
+                }
+                get_next_token(); // consume ')'
+                groups.pop_back(); // the parenthesized operand stays on the stack
+                continue;
+            }
+
+            // an argument of the innermost call is complete
+            open_group_state &call = group;
+            call.arg_depth = std::max(call.arg_depth, operands.back().depth);
+            call_args.push_back(operands.back().ref);
+            operands.pop_back();
+
+            if (current_token == ',') {
+                get_next_token(); // consume ','
+                break;
+            }
+
+            if (current_token != ')') {
+                log_error(source, token_span.offset,
+                        "Expected ')' of ',' in argument list, got " + 
+                        std::to_string(current_token) + " instead.");
+                return fail();
+            }
+            get_next_token(); // consume ')'
+            if (!close_call())
+                return fail();
+        }
+    }
+}
+
+// prototype
+//   ::= id '(' id* ')'
+bool parser::parse_prototype(prototype_ast &proto) {
+    if (current_token != tok_identifier)
+        return log_error_proto(source, token_span.offset,
+                "Expected function name in prototype, got " +
+                std::to_string(current_token) + " instead");
+
+    uint32_t fn_location = token_span.offset;
+    symbol fn_name = identifier_symbol;
+    get_next_token();
+    if(current_token != '(') 
+        return log_error_proto(source, token_span.offset,
+                "Expected '(' in prototype, got " + 
+                std::to_string(current_token) + " instead.");
+
+    // Read the list of argument names
+    small_vector<symbol, 4> arg_names;
+    while (get_next_token() == tok_identifier) 
+        arg_names.push_back(identifier_symbol);
+    if (current_token != ')')
+        return log_error_proto(source, token_span.offset,
+                "Expected ')' in prototype, got " +
+                std::to_string(current_token) + " instead.");
+
+    // success
+    get_next_token(); // consume ')'
+    
+    proto = { fn_location, fn_name, pool.add_params(arg_names.data(), arg_names.size()),
+        static_cast<uint32_t>(arg_names.size()) };
+    return true;
+
+}
+
+// definition 
+//   ::= 'def' prototype expression
+std::unique_ptr<function_ast> parser::parse_definition() {
+    get_next_token(); // consume 'def'
+    new_pool();
+    prototype_ast proto;
+    if (!parse_prototype(proto))
+        return nullptr;
+
+    if (auto expr = parse_expression())
+        return make_function(proto, expr);
+    return nullptr;
+}
+
+// external
+//   ::= 'extern' prototype
+std::unique_ptr<function_ast> parser::parse_extern() {
+    get_next_token(); // consume 'extern'
+    new_pool();
+    prototype_ast proto;
+    if (parse_prototype(proto))
+        return make_function(proto, expr_ref());
+    return nullptr;
+}
+
+
+// toplevel expression
+//  ::= expression
+std::unique_ptr<function_ast> parser::parse_top_level_expr() {
+    new_pool();
+    uint32_t location = token_span.offset;
+    if (auto expr = parse_expression()) {
+        // make an anonymous proto
+        prototype_ast proto = { location, symbol_table::anonymous, 0, 0 };
+        return make_function(proto, expr);
+    }
+    return nullptr;
+}
+
+// command
+//   ::= ':' id
+bool parser::parse_command(std::string_view &name) {
+    get_next_token(); // consume ':'
+    if (current_token != tok_identifier)
+        return log_error_proto(source, token_span.offset, "Expected a command name after ':'");
+    name = lex.symbol_names().name(identifier_symbol);
+    get_next_token(); // consume the name
+    return true;
+}
+
+// ast_printer - writes a function as an s-expression, e.g.
+//   (def f (x y) (+ x (call g y 1))), or (expr ...) for a top-level expression
+class ast_printer: public expr_visitor<ast_printer, void> {
+    private:
+        const symbol_table &symbols;
+        std::ostream &out;
+        std::vector<const binary_expr_ast *> spine;
+        bool exhausted = false; // the native stack ran out before the tree did
+
+    public:
+        ast_printer(const ast_pool &pool, const symbol_table &symbols, std::ostream &out) :
+            expr_visitor(pool), symbols(symbols), out(out) {}
+
+        // visit - print ref, or stop printing once the native stack runs out
+        void visit(expr_ref ref) {
+            if (exhausted || stack_exhausted()) {
+                exhausted = true;
+                return;
+            }
+            expr_visitor::visit(ref);
+        }
+
+        void visit_number(const number_expr_ast &node) {
+            // shortest text that reads back as the same double
+            char text[32];
+            auto result = std::to_chars(text, text + sizeof(text), node.value);
+            out.write(text, result.ptr - text);
+        }
+
+        void visit_variable(const variable_expr_ast &node) {
+            out << symbols.name(node.name);
+        }
+
+        void visit_binary(const binary_expr_ast &node) {
+            size_t base = spine.size();
+            left_spine(pool, node, spine);
+            for (size_t i = base; i < spine.size(); ++i)
+                out << '(' << spine[i]->op << ' ';
+            visit(spine.back()->lhs);
+            for (size_t i = spine.size(); i-- > base;) {
+                out << ' ';
+                visit(spine[i]->rhs);
+                out << ')';
+            }
+            spine.resize(base);
+        }
+
+        void visit_call(const call_expr_ast &node) {
+            out << "(call " << symbols.name(node.callee);
+            for (expr_ref arg : pool.call_args(node)) {
+                out << ' ';
+                visit(arg);
+            }
+            out << ')';
+        }
+
+        void visit_if(const if_expr_ast &node) {
+            out << "(if ";
+            visit(node.condition);
+            out << ' ';
+            visit(node.then_expr);
+            out << ' ';
+            visit(node.else_expr);
+            out << ')';
+        }
+
+        // print - write fn; false if it is nested too deeply to print, in
+        // which case what was written is incomplete
+        bool print(const function_ast &fn) {
+            const prototype_ast &proto = fn.get_proto();
+            if (proto.name == symbol_table::anonymous) {
+                out << "(expr ";
+                visit(fn.get_body());
+                out << ")\n";
+                return !exhausted;
+            }
+            out << (fn.is_extern() ? "(extern " : "(def ") << symbols.name(proto.name) << " (";
+            const char *separator = "";
+            for (symbol arg : pool.proto_args(proto)) {
+                out << separator << symbols.name(arg);
+                separator = " ";
+            }
+            out << ')';
+            if (!fn.is_extern()) {
+                out << ' ';
+                visit(fn.get_body());
+            }
+            out << ")\n";
+            return !exhausted;
+        }
+};
+
+// AST cache
+//
+// The functions parsed from a file can be saved as one binary image: the
+// symbol names, then each function's prototype and node arrays exactly as
+// they are laid out in memory. Everything in the image is addressed by
+// offsets from its start, so it can be mapped anywhere, and pools are views
+// straight into the mapping, so loading it does no parsing and no copying.
+// The mapping is read-only and shared, so processes started on the same file
+// share one copy of the cache in the page cache.
+//
+// The header carries a format version, a description of the record layout,
+// the size and hash of the source the image was made from, a hash of the
+// parser options it was parsed with, and a checksum of everything after the
+// header. An image that fails any of these checks, or whose records point
+// outside their arrays, is ignored.
+
+// hash_bytes - 64-bit FNV-1a over 8-byte words, for source keys and checksums
+static uint64_t hash_bytes(const char *data, size_t size) {
+    const uint64_t prime = 1099511628211ull;
+    uint64_t h = 14695981039346656037ull ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof word);
+        h = (h ^ word) * prime;
+        h ^= h >> 32;
+    }
+    for (; i < size; ++i)
+        h = (h ^ static_cast<unsigned char>(data[i])) * prime;
+    return h;
+}
+
+class ast_cache {
+    private:
+        static constexpr char magic[8] = { 'K', 'S', 'A', 'S', 'T', 'C', '\0', '\0' };
+        static constexpr uint32_t version = 3;
+        static constexpr uint32_t byte_order = 0x01020304;
+        // layout - sizes of the records stored in the image, so an image
+        // written by a build with a different layout is rejected
+        static constexpr uint64_t layout = sizeof(number_expr_ast)
+            | sizeof(variable_expr_ast) << 8 | sizeof(binary_expr_ast) << 16
+            | sizeof(call_expr_ast) << 24 | uint64_t(sizeof(prototype_ast)) << 32
+            | uint64_t(sizeof(expr_ref)) << 40 | uint64_t(sizeof(symbol)) << 48
+            | uint64_t(sizeof(if_expr_ast)) << 56;
+
+        // section - count elements at offset bytes from the image start
+        struct section {
+            uint64_t offset;
+            uint64_t count;
+        };
+
+        // The nodes of all functions are stored in one array per kind; each
+        // function's pool views a run of every array.
+        struct header {
+            char magic[8];
+            uint32_t version;
+            uint32_t byte_order;
+            uint64_t layout;
+            uint64_t image_size;
+            uint64_t checksum;      // of the bytes after the header
+            uint64_t source_size;
+            uint64_t source_hash;
+            uint64_t options_hash;  // of parser::options
+            section symbol_offsets; // symbol i is text[offsets[i], offsets[i + 1])
+            section symbol_text;
+            section numbers, variables, binaries, calls, conditionals, args, params;
+            section functions;      // function_record
+        };
+
+        // run - count elements from index first of one of the node arrays
+        struct run {
+            uint32_t first;
+            uint32_t count;
+        };
+
+        struct function_record {
+            prototype_ast proto;
+            expr_ref body;
+            run numbers, variables, binaries, calls, conditionals, args, params;
+        };
+
+        const char *image = nullptr;
+        size_t image_size = 0;
+        std::vector<function_ast> functions;
+
+        ast_cache() = default;
+
+        static uint64_t append(std::string &image, const void *data, size_t size) {
+            image.resize((image.size() + 7) & ~size_t(7));
+            uint64_t offset = image.size();
+            image.append(static_cast<const char *>(data), size);
+            return offset;
+        }
+
+        template <typename T>
+        static section append(std::string &image, const std::vector<T> &items) {
+            return { append(image, items.data(), items.size() * sizeof(T)), items.size() };
+        }
+
+        // gather - append items to all, returning where they went
+        template <typename T>
+        static run gather(std::vector<T> &all, array_view<T> items) {
+            run r = { static_cast<uint32_t>(all.size()), static_cast<uint32_t>(items.size()) };
+            all.insert(all.end(), items.begin(), items.end());
+            return r;
+        }
+
+        // part - the run r of items, or false if it lies outside them
+        template <typename T>
+        static bool part(array_view<T> items, run r, array_view<T> &out) {
+            if (r.first > items.size() || r.count > items.size() - r.first)
+                return false;
+            out = array_view<T>(items.begin() + r.first, r.count);
+            return true;
+        }
+
+        // view - set out to the elements of s; false if s lies outside the
+        // image or is misaligned
+        template <typename T>
+        bool view(const section &s, array_view<T> &out) const {
+            if (s.offset % alignof(T) != 0 || s.offset > image_size ||
+                    s.count > (image_size - s.offset) / sizeof(T))
+                return false;
+            out = array_view<T>(reinterpret_cast<const T *>(image + s.offset), s.count);
+            return true;
+        }
+
+        // valid_ref - whether ref is a node of pool
+        static bool valid_ref(const ast_pool &pool, expr_ref ref) {
+            switch (ref.kind()) {
+                case expr_kind::number: return ref.index() < pool.all<number_expr_ast>().size();
+                case expr_kind::variable: return ref.index() < pool.all<variable_expr_ast>().size();
+                case expr_kind::binary: return ref.index() < pool.all<binary_expr_ast>().size();
+                case expr_kind::call: return ref.index() < pool.all<call_expr_ast>().size();
+                case expr_kind::conditional: return ref.index() < pool.all<if_expr_ast>().size();
+            }
+            return false;
+        }
+
+        // valid_run - whether count elements from first lie within size
+        static bool valid_run(size_t size, uint32_t first, uint32_t count) {
+            return first <= size && count <= size - first;
+        }
+
+        // acyclic - whether no node of pool is its own descendant, found by a
+        // depth-first walk that knows which nodes are on its current path
+        static bool acyclic(const ast_pool &pool) {
+            enum : uint8_t { unseen, on_path, done };
+            std::vector<uint8_t> states[] = {
+                std::vector<uint8_t>(pool.all<number_expr_ast>().size(), unseen),
+                std::vector<uint8_t>(pool.all<variable_expr_ast>().size(), unseen),
+                std::vector<uint8_t>(pool.all<binary_expr_ast>().size(), unseen),
+                std::vector<uint8_t>(pool.all<call_expr_ast>().size(), unseen),
+                std::vector<uint8_t>(pool.all<if_expr_ast>().size(), unseen),
+            };
+            std::vector<std::pair<expr_ref, bool>> stack; // node, and whether it is being left
+            for (expr_kind kind : { expr_kind::binary, expr_kind::call, expr_kind::conditional }) {
+                for (uint32_t i = 0; i < states[static_cast<size_t>(kind)].size(); ++i) {
+                    stack.push_back({ expr_ref(kind, i), false });
+                    while (!stack.empty()) {
+                        auto [ref, leaving] = stack.back();
+                        stack.pop_back();
+                        uint8_t &state = states[static_cast<size_t>(ref.kind())][ref.index()];
+                        if (leaving) {
+                            state = done;
+                            continue;
+                        }
+                        if (state == on_path)
+                            return false;
+                        if (state == done)
+                            continue;
+                        state = on_path;
+                        stack.push_back({ ref, true });
+                        if (const binary_expr_ast *node = dyn_cast<binary_expr_ast>(pool, ref)) {
+                            stack.push_back({ node->lhs, false });
+                            stack.push_back({ node->rhs, false });
+                        } else if (const call_expr_ast *node = dyn_cast<call_expr_ast>(pool, ref)) {
+                            for (expr_ref arg : pool.call_args(*node))
+                                stack.push_back({ arg, false });
+                        } else if (const if_expr_ast *node = dyn_cast<if_expr_ast>(pool, ref)) {
+                            stack.push_back({ node->condition, false });
+                            stack.push_back({ node->then_expr, false });
+                            stack.push_back({ node->else_expr, false });
+                        }
+                    }
+                }
+            }
+            return true;
+        }
+
+        // well_formed - whether every reference and run in fn stays within
+        // its pool, every symbol within symbol_count and every location
+        // within the source, and its nodes form a DAG. The checksum catches
+        // damage; this keeps an image crafted to pass it from sending the
+        // passes outside the mapping or round a loop.
+        static bool well_formed(const function_ast &fn, size_t symbol_count, size_t source_size) {
+            const ast_pool &pool = fn.nodes();
+            const prototype_ast &proto = fn.get_proto();
+            if (proto.location > source_size || proto.name >= symbol_count ||
+                    !valid_run(pool.all_params().size(), proto.first_arg, proto.arg_count) ||
+                    (fn.get_body() && !valid_ref(pool, fn.get_body())))
+                return false;
+            for (symbol param : pool.all_params()) {
+                if (param >= symbol_count)
+                    return false;
+            }
+            for (expr_ref arg : pool.all_args()) {
+                if (!valid_ref(pool, arg))
+                    return false;
+            }
+            for (const number_expr_ast &node : pool.all<number_expr_ast>()) {
+                if (node.location > source_size)
+                    return false;
+            }
+            for (const variable_expr_ast &node : pool.all<variable_expr_ast>()) {
+                if (node.location > source_size || node.name >= symbol_count)
+                    return false;
+            }
+            for (const binary_expr_ast &node : pool.all<binary_expr_ast>()) {
+                if (node.location > source_size || !valid_ref(pool, node.lhs) ||
+                        !valid_ref(pool, node.rhs))
+                    return false;
+            }
+            for (const call_expr_ast &node : pool.all<call_expr_ast>()) {
+                if (node.location > source_size || node.callee >= symbol_count ||
+                        !valid_run(pool.all_args().size(), node.first_arg, node.arg_count))
+                    return false;
+            }
+            for (const if_expr_ast &node : pool.all<if_expr_ast>()) {
+                if (node.location > source_size || !valid_ref(pool, node.condition) ||
+                        !valid_ref(pool, node.then_expr) || !valid_ref(pool, node.else_expr))
+                    return false;
+            }
+            return acyclic(pool);
+        }
+
+    public:
+        ast_cache(const ast_cache &) = delete;
+        ast_cache &operator=(const ast_cache &) = delete;
+
+        ~ast_cache() {
+            functions.clear();
+            if (image)
+                munmap(const_cast<char *>(image), image_size);
+        }
+
+        // open - map the cache at path if it was made from source parsed with
+        // options, and seed symbols with its names. symbols must not have been
+        // used yet, so that every symbol gets the number it had when the cache
+        // was written.
+        static std::unique_ptr<ast_cache> open(const char *path, const source_buffer &source,
+                std::string_view options, symbol_table &symbols) {
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0)
+                return nullptr;
+            struct stat st;
+            void *mapping = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(header))
+                mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (mapping == MAP_FAILED)
+                return nullptr;
+
+            std::unique_ptr<ast_cache> cache(new ast_cache());
+            cache->image = static_cast<const char *>(mapping);
+            cache->image_size = st.st_size;
+
+            const header &h = *reinterpret_cast<const header *>(cache->image);
+            if (memcmp(h.magic, magic, sizeof magic) != 0 || h.version != version ||
+                    h.byte_order != byte_order || h.layout != layout ||
+                    h.image_size != cache->image_size || h.source_size != source.size() ||
+                    symbols.size() != 1)
+                return nullptr;
+            if (h.source_hash != hash_bytes(source.data(), source.size()) ||
+                    h.options_hash != hash_bytes(options.data(), options.size()) ||
+                    h.checksum != hash_bytes(cache->image + sizeof(header),
+                        cache->image_size - sizeof(header)))
+                return nullptr;
+
+            array_view<uint32_t> offsets;
+            array_view<char> text;
+            array_view<number_expr_ast> numbers;
+            array_view<variable_expr_ast> variables;
+            array_view<binary_expr_ast> binaries;
+            array_view<call_expr_ast> calls;
+            array_view<if_expr_ast> conditionals;
+            array_view<expr_ref> args;
+            array_view<symbol> params;
+            array_view<function_record> records;
+            if (!cache->view(h.symbol_offsets, offsets) || !cache->view(h.symbol_text, text) ||
+                    !cache->view(h.numbers, numbers) || !cache->view(h.variables, variables) ||
+                    !cache->view(h.binaries, binaries) || !cache->view(h.calls, calls) ||
+                    !cache->view(h.conditionals, conditionals) || !cache->view(h.args, args) || !cache->view(h.params, params) ||
+                    !cache->view(h.functions, records) || offsets.size() == 0)
+                return nullptr;
+            for (size_t i = 1; i + 1 < offsets.size(); ++i) {
+                if (offsets[i] > offsets[i + 1] || offsets[i + 1] > text.size())
+                    return nullptr;
+                std::string_view name(text.begin() + offsets[i], offsets[i + 1] - offsets[i]);
+                if (symbols.intern(name) != i)
+                    return nullptr;
+            }
+
+            cache->functions.reserve(records.size());
+            for (const function_record &r : records) {
+                array_view<number_expr_ast> fn_numbers;
+                array_view<variable_expr_ast> fn_variables;
+                array_view<binary_expr_ast> fn_binaries;
+                array_view<call_expr_ast> fn_calls;
+                array_view<if_expr_ast> fn_conditionals;
+                array_view<expr_ref> fn_args;
+                array_view<symbol> fn_params;
+                if (!part(numbers, r.numbers, fn_numbers) ||
+                        !part(variables, r.variables, fn_variables) ||
+                        !part(binaries, r.binaries, fn_binaries) ||
+                        !part(calls, r.calls, fn_calls) ||
+                        !part(conditionals, r.conditionals, fn_conditionals) ||
+                        !part(args, r.args, fn_args) ||
+                        !part(params, r.params, fn_params))
+                    return nullptr;
+                cache->functions.emplace_back(ast_pool::mapped(fn_numbers, fn_variables,
+                            fn_binaries, fn_calls, fn_conditionals, fn_args, fn_params),
+                        r.proto, r.body);
+                if (!well_formed(cache->functions.back(), symbols.size(), source.size()))
+                    return nullptr;
+            }
+            return cache;
+        }
+
+        // write - save functions, parsed from source under options with
+        // symbols, to path.
+        // The image is written to a temporary file that is then renamed over
+        // path, so a process mapping path never sees a partial image.
+        static bool write(const char *path, const source_buffer &source, std::string_view options,
+                const symbol_table &symbols, const std::vector<std::unique_ptr<function_ast>> &fns) {
+            std::string image(sizeof(header), '\0');
+            header h = {};
+            memcpy(h.magic, magic, sizeof magic);
+            h.version = version;
+            h.byte_order = byte_order;
+            h.layout = layout;
+            h.source_size = source.size();
+            h.source_hash = hash_bytes(source.data(), source.size());
+            h.options_hash = hash_bytes(options.data(), options.size());
+
+            std::vector<uint32_t> offsets = { 0 };
+            std::string text;
+            for (symbol sym = 0; sym < symbols.size(); ++sym) {
+                text += symbols.name(sym);
+                offsets.push_back(text.size());
+            }
+            h.symbol_offsets = append(image, offsets);
+            h.symbol_text = append(image, std::vector<char>(text.begin(), text.end()));
+
+            std::vector<number_expr_ast> numbers;
+            std::vector<variable_expr_ast> variables;
+            std::vector<binary_expr_ast> binaries;
+            std::vector<call_expr_ast> calls;
+            std::vector<if_expr_ast> conditionals;
+            std::vector<expr_ref> args;
+            std::vector<symbol> params;
+            std::vector<function_record> records;
+            records.reserve(fns.size());
+            for (const std::unique_ptr<function_ast> &fn : fns) {
+                const ast_pool &pool = fn->nodes();
+                function_record r = {};
+                r.proto = fn->get_proto();
+                r.body = fn->get_body();
+                r.numbers = gather(numbers, pool.all<number_expr_ast>());
+                r.variables = gather(variables, pool.all<variable_expr_ast>());
+                r.binaries = gather(binaries, pool.all<binary_expr_ast>());
+                r.calls = gather(calls, pool.all<call_expr_ast>());
+                r.conditionals = gather(conditionals, pool.all<if_expr_ast>());
+                r.args = gather(args, pool.all_args());
+                r.params = gather(params, pool.all_params());
+                records.push_back(r);
+            }
+            h.numbers = append(image, numbers);
+            h.variables = append(image, variables);
+            h.binaries = append(image, binaries);
+            h.calls = append(image, calls);
+            h.conditionals = append(image, conditionals);
+            h.args = append(image, args);
+            h.params = append(image, params);
+            h.functions = append(image, records);
+
+            h.image_size = image.size();
+            h.checksum = hash_bytes(image.data() + sizeof(header), image.size() - sizeof(header));
+            memcpy(&image[0], &h, sizeof h);
+
+            std::string temporary = std::string(path) + ".tmp." + std::to_string(getpid());
+            FILE *out = fopen(temporary.c_str(), "wb");
+            if (!out)
+                return false;
+            bool written = fwrite(image.data(), 1, image.size(), out) == image.size();
+            written = fclose(out) == 0 && written;
+            if (!written || rename(temporary.c_str(), path) != 0) {
+                remove(temporary.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        const std::vector<function_ast> &cached_functions() const {
+            return functions;
+        }
+};
+
+// native_function - the address of a host function, whatever its parameters
+typedef void (*native_function)();
+
+template <typename... Args>
+static native_function to_native(double (*f)(Args...)) {
+    return reinterpret_cast<native_function>(f);
+}
+
+// builtin - a host function that an extern can name. Every builtin takes
+// and returns doubles, so generated code can call address directly.
+struct builtin {
+    std::string_view name;
+    uint32_t arg_count;
+    native_function address;
+
+    double call(const double *args) const {
+        switch (arg_count) {
+            case 1:
+                return reinterpret_cast<double (*)(double)>(address)(args[0]);
+            case 2:
+                return reinterpret_cast<double (*)(double, double)>(address)(args[0], args[1]);
+        }
+        __builtin_unreachable();
+    }
+};
+
+static const builtin builtins[] = {
+    { "sin", 1, to_native(+[](double x) { return std::sin(x); }) },
+    { "cos", 1, to_native(+[](double x) { return std::cos(x); }) },
+    { "tan", 1, to_native(+[](double x) { return std::tan(x); }) },
+    { "atan2", 2, to_native(+[](double y, double x) { return std::atan2(y, x); }) },
+    { "sqrt", 1, to_native(+[](double x) { return std::sqrt(x); }) },
+    { "exp", 1, to_native(+[](double x) { return std::exp(x); }) },
+    { "log", 1, to_native(+[](double x) { return std::log(x); }) },
+    { "pow", 2, to_native(+[](double x, double y) { return std::pow(x, y); }) },
+    { "fabs", 1, to_native(+[](double x) { return std::fabs(x); }) },
+    { "floor", 1, to_native(+[](double x) { return std::floor(x); }) },
+    // putchard - putchar that takes a double and returns 0
+    { "putchard", 1, to_native(+[](double c) { fputc(static_cast<char>(c), stderr); return 0.0; }) },
+    // printd - printf that takes a double, prints it as "%f\n" and returns 0
+    { "printd", 1, to_native(+[](double x) { fprintf(stderr, "%f\n", x); return 0.0; }) },
+};
+
+static const builtin *find_builtin(std::string_view name) {
+    for (const builtin &b : builtins) {
+        if (b.name == name)
+            return &b;
+    }
+    return nullptr;
+}
+
+// is_builtin_operator - whether op is one of the binary operators the
+// engines implement
+static bool is_builtin_operator(char op) {
+    return op == '+' || op == '-' || op == '*' || op == '/' || op == '<' || op == '>';
+}
+
+// program - every function defined so far, numbered densely in the order
+// their names were first seen, and the call graph between them. A name that
+// has only been called so far has an entry without a definition.
+//
+// Each definition is resolved when it is entered: every variable to the slot
+// of the parameter it names, every call to the callee's function index, and
+// an extern to the builtin it names. An operator registered with --binop
+// parses, but no engine gives it a meaning, so using one is an error. A call
+// to a function defined with a different number of parameters is an error,
+// and a call to a function not defined yet leaves the caller unresolved
+// until it is. Function indices
+// never change, so a redefinition leaves callers' resolved calls valid. It
+// rechecks only the function and its direct callers, the only functions whose
+// check can change, so its cost follows the size of its neighbourhood in the
+// call graph rather than the size of the program.
+class program {
+    public:
+        static constexpr uint32_t no_function = ~0u;
+        static constexpr uint32_t no_slot = ~0u;
+
+        // resolution - what the names in one function refer to, by node index
+        struct resolution {
+            std::vector<uint32_t> slots;   // of each variable node, its parameter slot
+            std::vector<uint32_t> targets; // of each call node, the callee's function index
+            bool resolved = false;         // every name and call matches a definition
+            bool locals_resolved = false;  // every variable and operator, which never change
+        };
+
+        struct function_entry {
+            symbol name;
+            const function_ast *fn = nullptr; // current definition
+            std::unique_ptr<function_ast> owned; // fn, unless it is borrowed
+            const builtin *native = nullptr; // for an extern
+            resolution names;
+            std::vector<uint32_t> callees; // functions fn calls, each once
+            std::vector<uint32_t> callers; // functions whose definitions call this one
+            uint32_t generation = 0; // changes whenever fn or names change
+        };
+
+    private:
+        const source_buffer &source;
+        const symbol_table &symbols;
+        std::vector<function_entry> functions;
+        std::vector<uint32_t> function_of_symbol; // indexed by symbol
+
+        // entry_for - the index of name's entry, adding one if it has none
+        uint32_t entry_for(symbol name) {
+            if (name >= function_of_symbol.size())
+                function_of_symbol.resize(std::max<size_t>(name + 1, symbols.size()), no_function);
+            uint32_t &index = function_of_symbol[name];
+            if (index == no_function) {
+                index = functions.size();
+                functions.emplace_back();
+                functions.back().name = name;
+            }
+            return index;
+        }
+
+        // resolve_variables - give every variable of fn its parameter slot,
+        // reporting names that are not parameters. These never change once a
+        // function is defined.
+        bool resolve_variables(const function_ast &fn, resolution &names) {
+            const ast_pool &pool = fn.nodes();
+            array_view<symbol> params = pool.proto_args(fn.get_proto());
+            bool resolved = true;
+            names.slots.clear();
+            for (const variable_expr_ast &var : pool.all<variable_expr_ast>()) {
+                auto param = std::find(params.begin(), params.end(), var.name);
+                if (param == params.end()) {
+                    report_error(std::cerr, source, var.location,
+                            "unknown variable name " + std::string(symbols.name(var.name)));
+                    names.slots.push_back(no_slot);
+                    resolved = false;
+                } else {
+                    names.slots.push_back(param - params.begin());
+                }
+            }
+            return resolved;
+        }
+
+        // check_operators - report binary operators of fn that no engine
+        // implements; true if there are none
+        bool check_operators(const function_ast &fn) {
+            bool resolved = true;
+            for (const binary_expr_ast &node : fn.nodes().all<binary_expr_ast>()) {
+                if (!is_builtin_operator(node.op)) {
+                    report_error(std::cerr, source, node.location,
+                            std::string("operator ") + node.op + " has no definition");
+                    resolved = false;
+                }
+            }
+            return resolved;
+        }
+
+        // check_calls - report calls in fn that do not match their callee's
+        // definition; true if every call has a matching definition. Calls to
+        // functions not defined yet are only reported if report_undefined.
+        bool check_calls(const function_ast &fn, const resolution &names, bool report_undefined) {
+            bool resolved = true;
+            array_view<call_expr_ast> calls = fn.nodes().all<call_expr_ast>();
+            for (size_t i = 0; i < calls.size(); ++i) {
+                const call_expr_ast &call = calls[i];
+                const function_ast *target = functions[names.targets[i]].fn;
+                if (!target) {
+                    if (report_undefined)
+                        report_error(std::cerr, source, call.location, "unknown function " +
+                                std::string(symbols.name(call.callee)));
+                    resolved = false;
+                } else if (target->get_proto().arg_count != call.arg_count) {
+                    report_error(std::cerr, source, call.location,
+                            std::string(symbols.name(call.callee)) + " takes " +
+                            std::to_string(target->get_proto().arg_count) +
+                            " arguments but is called with " + std::to_string(call.arg_count));
+                    resolved = false;
+                }
+            }
+            return resolved;
+        }
+
+        // resolve - resolve every name in fn, true if all of them match a
+        // definition
+        bool resolve(const function_ast &fn, resolution &names, bool report_undefined) {
+            bool variables_resolved = resolve_variables(fn, names);
+            names.locals_resolved = check_operators(fn) && variables_resolved;
+            names.targets.clear();
+            for (const call_expr_ast &call : fn.nodes().all<call_expr_ast>())
+                names.targets.push_back(entry_for(call.callee));
+            return check_calls(fn, names, report_undefined) && names.locals_resolved;
+        }
+
+        // recheck - check entry's calls again after a callee changed
+        void recheck(function_entry &entry) {
+            ++entry.generation;
+            entry.names.resolved = check_calls(*entry.fn, entry.names, false) &&
+                entry.names.locals_resolved;
+        }
+
+        // install - make fn the definition of its name and recheck what it affects
+        size_t install(const function_ast &fn, std::unique_ptr<function_ast> owned) {
+            uint32_t index = entry_for(fn.get_name());
+
+            // replace the old definition's edges with the new one's
+            for (uint32_t callee : functions[index].callees) {
+                std::vector<uint32_t> &callers = functions[callee].callers;
+                auto edge = std::find(callers.begin(), callers.end(), index);
+                *edge = callers.back();
+                callers.pop_back();
+            }
+            // defined before resolving, so that recursive calls resolve
+            functions[index].fn = &fn;
+            resolution names;
+            names.resolved = resolve(fn, names, false);
+            std::vector<uint32_t> callees = names.targets;
+            std::sort(callees.begin(), callees.end());
+            callees.erase(std::unique(callees.begin(), callees.end()), callees.end());
+            for (uint32_t callee : callees)
+                functions[callee].callers.push_back(index);
+
+            function_entry &entry = functions[index];
+            ++entry.generation;
+            entry.owned = std::move(owned);
+            entry.names = std::move(names);
+            entry.callees = std::move(callees);
+            entry.native = nullptr;
+            if (fn.is_extern()) {
+                entry.native = find_builtin(symbols.name(fn.get_name()));
+                if (!entry.native || entry.native->arg_count != fn.get_proto().arg_count) {
+                    report_error(std::cerr, source, fn.get_proto().location,
+                            "no builtin " + std::string(symbols.name(fn.get_name())) +
+                            " with " + std::to_string(fn.get_proto().arg_count) + " arguments");
+                    entry.native = nullptr;
+                    entry.names.resolved = false;
+                }
+            }
+
+            size_t rechecked = 0;
+            for (uint32_t caller : entry.callers) {
+                if (caller != index) {
+                    recheck(functions[caller]);
+                    ++rechecked;
+                }
+            }
+            return rechecked;
+        }
+
+    public:
+        program(const source_buffer &source, const symbol_table &symbols) :
+            source(source), symbols(symbols) {}
+
+        program(const program &) = delete;
+        program &operator=(const program &) = delete;
+
+        // define - add or replace a definition or extern, taking ownership of
+        // it. Returns how many callers of its name were rechecked.
+        size_t define(std::unique_ptr<function_ast> fn) {
+            const function_ast &definition = *fn;
+            return install(definition, std::move(fn));
+        }
+
+        // define - the same for a function that lives elsewhere, e.g. in a
+        // mapped AST cache, and outlives the program
+        size_t define(const function_ast &fn) {
+            return install(fn, nullptr);
+        }
+
+        // resolve_expression - resolve a top-level expression, which is run
+        // once and never becomes part of the call graph. Every problem,
+        // including calls to functions not defined yet, is reported.
+        bool resolve_expression(const function_ast &fn, resolution &names) {
+            names.resolved = resolve(fn, names, true);
+            return names.resolved;
+        }
+
+        // lookup - the index of name's entry, or no_function
+        uint32_t lookup(symbol name) const {
+            return name < function_of_symbol.size() ? function_of_symbol[name] : no_function;
+        }
+
+        // is_defined - true if name has a definition or extern
+        bool is_defined(symbol name) const {
+            uint32_t index = lookup(name);
+            return index != no_function && functions[index].fn;
+        }
+
+        const function_entry &function(uint32_t index) const {
+            return functions[index];
+        }
+
+        size_t size() const {
+            return functions.size();
+        }
+
+        const source_buffer &buffer() const {
+            return source;
+        }
+
+        const symbol_table &symbol_names() const {
+            return symbols;
+        }
+};
+
+// interpreter - evaluates functions of a program by walking their trees.
+// Arguments of every active call live in one flat array of doubles, and a
+// variable reads the slot its resolution gives relative to its call's frame.
+// A call evaluates its arguments onto the end of the array and jumps to the
+// function index its resolution gives. Nothing is looked up by name at run
+// time.
+class interpreter {
+    private:
+        const program &prog;
+        std::vector<double> values; // the frames of all active calls
+        std::vector<const binary_expr_ast *> spine; // of the chains being evaluated
+        bool failed = false;
+
+        // run_error - report a runtime error at location and unwind
+        double run_error(uint32_t location, const std::string &message) {
+            if (!failed)
+                report_error(std::cerr, prog.buffer(), location, message);
+            failed = true;
+            return 0;
+        }
+
+        // call - run function index with the arguments values[frame...]
+        double call(uint32_t index, size_t frame, uint32_t location) {
+            const program::function_entry &callee = prog.function(index);
+            if (callee.native)
+                return callee.native->call(values.data() + frame);
+            if (!callee.fn || !callee.names.resolved || callee.fn->is_extern())
+                return run_error(location, "cannot call " +
+                        std::string(prog.symbol_names().name(callee.name)) +
+                        ", it has errors or no definition");
+            return eval(*callee.fn, callee.names, callee.fn->get_body(), frame);
+        }
+
+        // eval - the value of the node ref of fn, whose arguments start at
+        // values[frame]. The side tables of the resolution are indexed by node
+        // index, so this switches on the reference itself rather than using
+        // expr_visitor, which hands over only the node. Running out of native
+        // stack is reported at fn rather than at the node where it happened,
+        // which depends on how large eval's frames are.
+        double eval(const function_ast &fn, const program::resolution &names, expr_ref ref,
+                size_t frame) {
+            if (failed)
+                return 0;
+            const ast_pool &pool = fn.nodes();
+            switch (ref.kind()) {
+                case expr_kind::number:
+                    return pool.get<number_expr_ast>(ref).value;
+                case expr_kind::variable:
+                    return values[frame + names.slots[ref.index()]];
+                case expr_kind::binary: {
+                    const binary_expr_ast &node = pool.get<binary_expr_ast>(ref);
+                    if (stack_exhausted())
+                        return run_error(fn.get_proto().location, "evaluation nested too deeply");
+                    size_t base = spine.size();
+                    left_spine(pool, node, spine);
+                    double value = eval(fn, names, spine.back()->lhs, frame);
+                    for (size_t i = spine.size(); i-- > base;)
+                        value = apply_binary(spine[i]->op, value, eval(fn, names, spine[i]->rhs, frame));
+                    spine.resize(base);
+                    return value;
+                }
+                case expr_kind::call: {
+                    const call_expr_ast &node = pool.get<call_expr_ast>(ref);
+                    if (stack_exhausted())
+                        return run_error(fn.get_proto().location, "evaluation nested too deeply");
+                    size_t callee_frame = values.size();
+                    for (expr_ref arg : pool.call_args(node)) {
+                        double value = eval(fn, names, arg, frame);
+                        values.push_back(value);
+                    }
+                    double result = call(names.targets[ref.index()], callee_frame, node.location);
+                    values.resize(callee_frame);
+                    return result;
+                }
+                case expr_kind::conditional: {
+                    const if_expr_ast &node = pool.get<if_expr_ast>(ref);
+                    if (stack_exhausted())
+                        return run_error(fn.get_proto().location, "evaluation nested too deeply");
+                    bool condition = eval(fn, names, node.condition, frame) != 0.0;
+                    return eval(fn, names, condition ? node.then_expr : node.else_expr, frame);
+                }
+            }
+            __builtin_unreachable();
+        }
+
+    public:
+        explicit interpreter(const program &prog): prog(prog) {}
+
+        // apply_binary - the value of lhs op rhs; comparisons give 1.0 or 0.0
+        static double apply_binary(char op, double lhs, double rhs) {
+            switch (op) {
+                case '+': return lhs + rhs;
+                case '-': return lhs - rhs;
+                case '*': return lhs * rhs;
+                case '/': return lhs / rhs;
+                case '<': return lhs < rhs ? 1.0 : 0.0;
+                case '>': return lhs > rhs ? 1.0 : 0.0;
+            }
+            __builtin_unreachable(); // resolution rejects other operators
+        }
+
+        // run - evaluate a top-level expression; false after a runtime error
+        bool run(const function_ast &fn, const program::resolution &names, double &result) {
+            values.clear();
+            spine.clear();
+            failed = false;
+            result = eval(fn, names, fn.get_body(), 0);
+            return !failed;
+        }
+
+        // run - the same for a call of function index on args at location,
+        // for an engine that cannot run the function itself
+        bool run(uint32_t index, const double *args, uint32_t location, double &result) {
+            const program::function_entry &entry = prog.function(index);
+            values.assign(args, args + (entry.fn ? entry.fn->get_proto().arg_count : 0));
+            spine.clear();
+            failed = false;
+            result = call(index, 0, location);
+            return !failed;
+        }
+};
+
+// Bytecode
+//
+// bytecode_compiler turns a resolved function into register-based bytecode.
+// The registers of a call are a window of one flat array of doubles: the
+// parameters are its first registers, followed by temporaries. A call puts
+// its arguments in consecutive registers of the caller, and those registers
+// become the first registers of the callee's window, so arguments are never
+// copied.
+
+enum class opcode : uint8_t {
+    load_constant,  // r[a] = constants[b]
+    move,           // r[a] = r[b]
+    add,            // r[a] = r[b] + r[c]
+    subtract,       // r[a] = r[b] - r[c]
+    multiply,       // r[a] = r[b] * r[c]
+    divide,         // r[a] = r[b] / r[c]
+    less,           // r[a] = r[b] < r[c]
+    greater,        // r[a] = r[b] > r[c]
+    jump,           // go to target
+    jump_if_false,  // go to target if r[a] is 0
+    call,           // r[a] = call_sites[c](r[b], ...)
+    ret,            // return r[a]
+};
+
+// instruction - an opcode with up to three 16-bit operands. Jumps keep their
+// 32-bit target in b and c.
+struct instruction {
+    opcode op;
+    uint8_t unused;
+    uint16_t a, b, c;
+
+    uint32_t target() const {
+        return static_cast<uint32_t>(b) << 16 | c;
+    }
+};
+static_assert(sizeof(instruction) == 8, "instructions should stay 8 bytes");
+
+// call_site - the callee and location of one call instruction
+struct call_site {
+    uint32_t function;
+    uint32_t location;
+};
+
+// bytecode_function - the compiled form of one function
+struct bytecode_function {
+    std::vector<instruction> code;
+    std::vector<double> constants;
+    std::vector<call_site> call_sites;
+    uint32_t register_count = 0;
+};
+
+class bytecode_compiler: public expr_visitor<bytecode_compiler, void> {
+    private:
+        static constexpr uint32_t operand_limit = UINT16_MAX;
+        static constexpr int any_register = -1;
+
+        const program::resolution &names;
+        bytecode_function &out;
+        std::unordered_map<uint64_t, uint32_t> constant_index; // by the bits of each constant
+        std::vector<const binary_expr_ast *> spine;
+        uint32_t next_register;
+        int dest = any_register; // where the node being visited puts its value
+        uint32_t result = 0;     // where it did put it
+        bool overflow = false;   // a register, constant or call site did not fit
+        bool exhausted = false;  // the native stack ran out before the tree did
+
+        uint16_t operand(size_t value) {
+            if (value > operand_limit) {
+                overflow = true;
+                return 0;
+            }
+            return static_cast<uint16_t>(value);
+        }
+
+        uint32_t allocate(uint32_t count = 1) {
+            uint32_t first = next_register;
+            next_register += count;
+            out.register_count = std::max(out.register_count, next_register);
+            operand(next_register);
+            return first;
+        }
+
+        // target_register - the register the node being visited must write
+        uint32_t target_register() {
+            return dest == any_register ? allocate() : static_cast<uint32_t>(dest);
+        }
+
+        void emit(opcode op, size_t a, size_t b = 0, size_t c = 0) {
+            out.code.push_back({ op, 0, operand(a), operand(b), operand(c) });
+        }
+
+        void patch_target(size_t jump, size_t target) {
+            out.code[jump].b = static_cast<uint16_t>(target >> 16);
+            out.code[jump].c = static_cast<uint16_t>(target);
+        }
+
+        // compile - emit code for ref, into dest unless it is any_register.
+        // Returns the register holding the value.
+        uint32_t compile(expr_ref ref, int to = any_register) {
+            if (exhausted || stack_exhausted()) {
+                exhausted = true;
+                return 0;
+            }
+            int saved = dest;
+            dest = to;
+            visit(ref);
+            dest = saved;
+            return result;
+        }
+
+    public:
+        // outcome - whether a function compiled, or why not
+        enum outcome { fits, too_large, too_deep };
+
+        bytecode_compiler(const function_ast &fn, const program::resolution &names,
+                bytecode_function &out) :
+            expr_visitor(fn.nodes()), names(names), out(out),
+            next_register(fn.get_proto().arg_count) {
+            out.register_count = next_register;
+        }
+
+        void visit_number(const number_expr_ast &node) {
+            uint32_t r = target_register();
+            uint64_t bits;
+            memcpy(&bits, &node.value, sizeof bits);
+            auto known = constant_index.try_emplace(bits, out.constants.size());
+            if (known.second)
+                out.constants.push_back(node.value);
+            emit(opcode::load_constant, r, known.first->second);
+            result = r;
+        }
+
+        void visit_variable(const variable_expr_ast &node) {
+            // parameters live in the first registers
+            uint32_t slot = names.slots[node_index(node)];
+            if (dest == any_register) {
+                result = slot;
+            } else {
+                emit(opcode::move, dest, slot);
+                result = dest;
+            }
+        }
+
+        void emit_binary(char op, uint32_t r, uint32_t lhs, uint32_t rhs) {
+            switch (op) {
+                case '+': emit(opcode::add, r, lhs, rhs); break;
+                case '-': emit(opcode::subtract, r, lhs, rhs); break;
+                case '*': emit(opcode::multiply, r, lhs, rhs); break;
+                case '/': emit(opcode::divide, r, lhs, rhs); break;
+                case '<': emit(opcode::less, r, lhs, rhs); break;
+                case '>': emit(opcode::greater, r, lhs, rhs); break;
+            }
+        }
+
+        void visit_binary(const binary_expr_ast &node) {
+            int to = dest;
+            uint32_t mark = next_register;
+            size_t base = spine.size();
+            left_spine(pool, node, spine);
+            uint32_t lhs = compile(spine.back()->lhs);
+            for (size_t i = spine.size(); i-- > base;) {
+                uint32_t rhs = compile(spine[i]->rhs);
+                next_register = mark;
+                // the inner links of a chain leave their value in one temporary
+                dest = i == base ? to : any_register;
+                uint32_t r = target_register();
+                emit_binary(spine[i]->op, r, lhs, rhs);
+                lhs = r;
+            }
+            spine.resize(base);
+            result = lhs;
+        }
+
+        void visit_call(const call_expr_ast &node) {
+            int to = dest;
+            uint32_t mark = next_register;
+            uint32_t base = allocate(node.arg_count);
+            uint32_t i = 0;
+            for (expr_ref arg : pool.call_args(node))
+                compile(arg, base + i++);
+            next_register = mark;
+            dest = to;
+            uint32_t r = target_register();
+            out.call_sites.push_back({ names.targets[node_index(node)], node.location });
+            emit(opcode::call, r, base, out.call_sites.size() - 1);
+            result = r;
+        }
+
+        void visit_if(const if_expr_ast &node) {
+            uint32_t r = target_register();
+            uint32_t mark = next_register;
+            uint32_t condition = compile(node.condition);
+            next_register = mark;
+            size_t to_else = out.code.size();
+            emit(opcode::jump_if_false, condition);
+            compile(node.then_expr, r);
+            next_register = mark;
+            size_t to_end = out.code.size();
+            emit(opcode::jump, 0);
+            patch_target(to_else, out.code.size());
+            compile(node.else_expr, r);
+            next_register = mark;
+            patch_target(to_end, out.code.size());
+            result = r;
+        }
+
+        // compile_function - compile the body of fn; too_large if it does
+        // not fit the 16-bit operands, too_deep if it is nested too deeply to
+        // compile on the native stack
+        outcome compile_function(const function_ast &fn) {
+            emit(opcode::ret, compile(fn.get_body()));
+            return exhausted ? too_deep : overflow ? too_large : fits;
+        }
+};
+
+// bytecode_vm - runs the bytecode of a program's functions. Functions are
+// compiled the first time they are called and again after their entry in the
+// program changes. Calls do not recurse on the native stack: the VM keeps its
+// own stack of return addresses. A function too large for the 16-bit operands
+// runs in the tree interpreter instead, if the VM has one.
+//
+// Where the compiler supports labels as values, each instruction ends by
+// jumping straight to the code of the next one (direct threading); otherwise
+// the loop dispatches through a switch.
+#if defined(__GNUC__)
+#define KALEIDOSCOPE_THREADED_DISPATCH 1
+#endif
+
+// native_tier - a tier that takes over functions once the VM has called them
+// threshold times. promote hands it a hot function, entries holds the address
+// of the code it has compiled for each function index (0 until it has some),
+// and call runs that code on the arguments of a call, reporting any error.
+struct native_tier {
+    void *owner;
+    uint32_t threshold;
+    const uintptr_t *entries;
+    void (*promote)(void *owner, uint32_t index);
+    bool (*call)(void *owner, uintptr_t entry, const double *args, uint32_t location, double &result);
+};
+
+class bytecode_vm {
+    private:
+        // compiled_function - the bytecode of one function, and the
+        // generation of its program entry that it was compiled from
+        struct compiled_function {
+            bytecode_function code;
+            uint32_t generation = ~0u;
+            bool usable = false;
+            bool too_large = false; // resolved, but does not fit the operands
+            bool too_deep = false; // resolved, but nested too deeply to compile
+            uint32_t calls = 0; // counted while there is a tier above
+        };
+
+        struct return_address {
+            const bytecode_function *fn;
+            const instruction *pc;
+            size_t base;
+            uint16_t dest;
+        };
+
+        const program &prog;
+        interpreter *fallback; // for functions too large for bytecode, if any
+        std::vector<compiled_function> functions; // indexed by function index
+        std::vector<double> registers;
+        std::vector<return_address> returns;
+        const native_tier *tier = nullptr;
+        size_t frame_top = 0; // where a call back from the tier above puts its frame
+
+        bool run_error(uint32_t location, const std::string &message) {
+            report_error(std::cerr, prog.buffer(), location, message);
+            return false;
+        }
+
+        // prepare - the up to date bytecode of function index, or null if it
+        // cannot be run as bytecode
+        const bytecode_function *prepare(uint32_t index) {
+            const program::function_entry &entry = prog.function(index);
+            compiled_function &compiled = functions[index];
+            if (compiled.generation != entry.generation) {
+                compiled.generation = entry.generation;
+                compiled.calls = 0;
+                compiled.code = bytecode_function();
+                bool runnable = entry.fn && !entry.fn->is_extern() && entry.names.resolved;
+                bytecode_compiler::outcome outcome = bytecode_compiler::fits;
+                if (runnable)
+                    outcome = bytecode_compiler(*entry.fn, entry.names, compiled.code).compile_function(*entry.fn);
+                compiled.usable = runnable && outcome == bytecode_compiler::fits;
+                compiled.too_large = runnable && outcome == bytecode_compiler::too_large;
+                compiled.too_deep = runnable && outcome == bytecode_compiler::too_deep;
+                if (runnable && !compiled.usable)
+                    compiled.code = bytecode_function();
+            }
+            return compiled.usable ? &compiled.code : nullptr;
+        }
+
+        // run_elsewhere - run function index, which prepare could not compile,
+        // on args: in the interpreter if it is only too large for bytecode,
+        // otherwise report why it cannot run
+        bool run_elsewhere(uint32_t index, const double *args, uint32_t location, double &result) {
+            std::string name(prog.symbol_names().name(prog.function(index).name));
+            if (functions[index].too_deep)
+                return run_error(location, name + " is nested too deeply to compile");
+            if (!functions[index].too_large)
+                return run_error(location, "cannot call " + name + ", it has errors or no definition");
+            if (!fallback)
+                return run_error(location, name + " is too large for bytecode");
+            return fallback->run(index, args, location, result);
+        }
+
+        // count_call - count a call of function index, promoting it to the
+        // tier above once it is hot
+        void count_call(uint32_t index) {
+            if (++functions[index].calls == tier->threshold)
+                tier->promote(tier->owner, index);
+        }
+
+        bool execute(const bytecode_function &entry_fn, size_t base, double &result);
+
+    public:
+        // max_call_depth - calls active at once before the VM gives up
+        static constexpr size_t max_call_depth = 1 << 20;
+
+        explicit bytecode_vm(const program &prog, interpreter *fallback = nullptr) :
+            prog(prog), fallback(fallback) {}
+
+        // set_tier - count calls and hand hot functions to next, or stop
+        // counting if it is null
+        void set_tier(const native_tier *next) {
+            tier = next;
+        }
+
+        // calls - the calls of function index counted since its definition
+        uint32_t calls(uint32_t index) const {
+            if (index >= functions.size() || functions[index].generation != prog.function(index).generation)
+                return 0;
+            return functions[index].calls;
+        }
+
+        // run - compile and run a top-level expression; false after an error
+        bool run(const function_ast &fn, const program::resolution &names, double &result) {
+            functions.resize(prog.size());
+            bytecode_function code;
+            bytecode_compiler::outcome outcome = bytecode_compiler(fn, names, code).compile_function(fn);
+            if (outcome == bytecode_compiler::too_deep)
+                return run_error(fn.get_proto().location, "expression is nested too deeply to compile");
+            if (outcome == bytecode_compiler::too_large) {
+                if (!fallback)
+                    return run_error(fn.get_proto().location, "expression is too large for bytecode");
+                return fallback->run(fn, names, result);
+            }
+            returns.clear();
+            frame_top = 0;
+            return execute(code, 0, result);
+        }
+
+        // call - run function index on args for code of the tier above,
+        // during a run; false after an error
+        bool call(uint32_t index, const double *args, double &result) {
+            const program::function_entry &entry = prog.function(index);
+            if (entry.native) {
+                result = entry.native->call(args);
+                return true;
+            }
+            const bytecode_function *target = prepare(index);
+            if (!target)
+                return run_elsewhere(index, args, entry.fn ? entry.fn->get_proto().location : 0, result);
+            count_call(index);
+            size_t base = frame_top;
+            if (registers.size() < base + target->register_count)
+                registers.resize(std::max(registers.size() * 2, base + target->register_count));
+            std::copy(args, args + entry.fn->get_proto().arg_count, registers.data() + base);
+            bool finished = execute(*target, base, result);
+            frame_top = base;
+            return finished;
+        }
+};
+
+#ifdef KALEIDOSCOPE_THREADED_DISPATCH
+// labels as values are a GNU extension
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+bool bytecode_vm::execute(const bytecode_function &entry_fn, size_t base, double &result) {
+    const bytecode_function *fn = &entry_fn;
+    const instruction *pc = fn->code.data();
+    const size_t outer_returns = returns.size(); // those of the runs this one is nested in
+    if (registers.size() < base + fn->register_count)
+        registers.resize(base + fn->register_count);
+    double *r = registers.data() + base;
+
+#ifdef KALEIDOSCOPE_THREADED_DISPATCH
+    static void *const labels[] = {
+        &&op_load_constant, &&op_move, &&op_add, &&op_subtract, &&op_multiply, &&op_divide,
+        &&op_less, &&op_greater, &&op_jump, &&op_jump_if_false, &&op_call, &&op_ret,
+    };
+#define VM_CASE(name) op_##name
+#define VM_DISPATCH() goto *labels[static_cast<size_t>(pc->op)]
+    VM_DISPATCH();
+#else
+#define VM_CASE(name) case opcode::name
+#define VM_DISPATCH() goto dispatch
+dispatch:
+    switch (pc->op) {
+#endif
+
+    VM_CASE(load_constant):
+        r[pc->a] = fn->constants[pc->b];
+        ++pc;
+        VM_DISPATCH();
+    VM_CASE(move):
+        r[pc->a] = r[pc->b];
+        ++pc;
+        VM_DISPATCH();
+    VM_CASE(add):
+        r[pc->a] = r[pc->b] + r[pc->c];
+        ++pc;
+        VM_DISPATCH();
+    VM_CASE(subtract):
+        r[pc->a] = r[pc->b] - r[pc->c];
+        ++pc;
+        VM_DISPATCH();
+    VM_CASE(multiply):
+        r[pc->a] = r[pc->b] * r[pc->c];
+        ++pc;
+        VM_DISPATCH();
+    VM_CASE(divide):
+        r[pc->a] = r[pc->b] / r[pc->c];
+        ++pc;
+        VM_DISPATCH();
+    VM_CASE(less):
+        r[pc->a] = r[pc->b] < r[pc->c] ? 1.0 : 0.0;
+        ++pc;
+        VM_DISPATCH();
+    VM_CASE(greater):
+        r[pc->a] = r[pc->b] > r[pc->c] ? 1.0 : 0.0;
+        ++pc;
+        VM_DISPATCH();
+    VM_CASE(jump):
+        pc = fn->code.data() + pc->target();
+        VM_DISPATCH();
+    VM_CASE(jump_if_false):
+        pc = r[pc->a] == 0.0 ? fn->code.data() + pc->target() : pc + 1;
+        VM_DISPATCH();
+    VM_CASE(call): {
+        const call_site &site = fn->call_sites[pc->c];
+        const program::function_entry &callee = prog.function(site.function);
+        if (callee.native) {
+            r[pc->a] = callee.native->call(r + pc->b);
+            ++pc;
+            VM_DISPATCH();
+        }
+        if (tier) {
+            // a function the tier above has compiled runs there
+            if (uintptr_t entry = __atomic_load_n(&tier->entries[site.function], __ATOMIC_ACQUIRE)) {
+                frame_top = base + fn->register_count;
+                double value;
+                if (!tier->call(tier->owner, entry, r + pc->b, site.location, value))
+                    return false;
+                // calls back into the VM may have moved the registers
+                r = registers.data() + base;
+                r[pc->a] = value;
+                ++pc;
+                VM_DISPATCH();
+            }
+        }
+        const bytecode_function *target = prepare(site.function);
+        if (!target) {
+            double value;
+            if (!run_elsewhere(site.function, r + pc->b, site.location, value))
+                return false;
+            r[pc->a] = value;
+            ++pc;
+            VM_DISPATCH();
+        }
+        if (tier)
+            count_call(site.function);
+        if (returns.size() >= max_call_depth)
+            return run_error(site.location, "call stack overflow");
+        returns.push_back({ fn, pc + 1, base, pc->a });
+        base += pc->b;
+        if (registers.size() < base + target->register_count)
+            registers.resize(std::max(registers.size() * 2, base + target->register_count));
+        fn = target;
+        pc = fn->code.data();
+        r = registers.data() + base;
+        VM_DISPATCH();
+    }
+    VM_CASE(ret): {
+        double value = r[pc->a];
+        if (returns.size() == outer_returns) {
+            result = value;
+            return true;
+        }
+        const return_address &back = returns.back();
+        fn = back.fn;
+        pc = back.pc;
+        base = back.base;
+        r = registers.data() + base;
+        r[back.dest] = value;
+        returns.pop_back();
+        VM_DISPATCH();
+    }
+
+#ifndef KALEIDOSCOPE_THREADED_DISPATCH
+    }
+    __builtin_unreachable();
+#endif
+#undef VM_CASE
+#undef VM_DISPATCH
+}
+
+#ifdef KALEIDOSCOPE_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef KALEIDOSCOPE_LLVM
+// Native code
+//
+// llvm_codegen emits LLVM IR for a resolved function, and native_jit compiles
+// it with ORC LLJIT. Every function index has a slot in one function table,
+// holding the address of the function's current native code (or of the
+// builtin an extern names), and generated calls load their callee from it.
+// Functions are compiled lazily: a slot stays empty until the first call
+// through it, which compiles the callee and fills the slot, so a session
+// only compiles the functions it calls. A redefinition empties the slots of
+// the function and of the callers that were rechecked against it.
+//
+// In the tiered engine the bytecode VM runs everything first and counts
+// calls. A function that reaches the threshold has its IR emitted and queued
+// for a background thread, which compiles it and then publishes its slot
+// together with an entry point that takes the arguments as an array, for
+// the VM to call. A call from generated code through a slot that is still
+// empty runs the callee in the VM instead of compiling it.
+
+// function_table - one native code address per function index. The table is
+// reserved once at its largest size and never moves, so generated code can
+// embed the addresses of its slots.
+class function_table {
+    private:
+        static constexpr size_t max_functions = size_t(1) << 22;
+        uintptr_t *slots = nullptr;
+
+    public:
+        function_table() {
+            void *reserved = mmap(nullptr, max_functions * sizeof(uintptr_t),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (reserved != MAP_FAILED)
+                slots = static_cast<uintptr_t *>(reserved);
+        }
+
+        ~function_table() {
+            if (slots)
+                munmap(slots, max_functions * sizeof(uintptr_t));
+        }
+
+        function_table(const function_table &) = delete;
+        function_table &operator=(const function_table &) = delete;
+
+        bool usable() const {
+            return slots != nullptr;
+        }
+
+        bool has_room_for(uint32_t index) const {
+            return index < max_functions;
+        }
+
+        const uintptr_t *slot(uint32_t index) const {
+            return &slots[index];
+        }
+
+        uintptr_t get(uint32_t index) const {
+            return __atomic_load_n(&slots[index], __ATOMIC_ACQUIRE);
+        }
+
+        void set(uint32_t index, uintptr_t address) {
+            __atomic_store_n(&slots[index], address, __ATOMIC_RELEASE);
+        }
+};
+
+class native_jit;
+
+// native_runtime - what generated code shares with the code that runs it.
+// Every function checks on entry that its frame is above stack_limit and
+// otherwise calls stack_overflow, and a call through an empty slot calls
+// compile_on_call, or interpret_on_call if tiered. They unwind to the setjmp
+// in exit, that of the innermost run of generated code, when they fail.
+struct native_runtime {
+    enum failure { none, overflow, uncallable, too_deep, reported };
+
+    native_jit *jit = nullptr;
+    bool tiered = false;
+    uintptr_t stack_limit = 0; // set by the outermost run
+    uint32_t runs = 0; // runs of generated code active at once
+    uint32_t uncallable_function = 0; // after an uncallable or too_deep failure
+    jmp_buf exit;
+};
+
+[[noreturn]] static void stack_overflow(native_runtime *runtime) {
+    longjmp(runtime->exit, native_runtime::overflow);
+}
+
+static uintptr_t compile_on_call(native_runtime *runtime, uint32_t index);
+static double interpret_on_call(native_runtime *runtime, uint32_t index, const double *args);
+
+class llvm_codegen: public expr_visitor<llvm_codegen, llvm::Value *> {
+    private:
+        llvm::LLVMContext &context;
+        llvm::IRBuilder<> builder;
+        const program::resolution &names;
+        const function_table &table;
+        native_runtime &runtime;
+        std::vector<llvm::Value *> params; // by slot
+        std::vector<const binary_expr_ast *> spine;
+        llvm::Type *double_type;
+        bool exhausted = false; // the native stack ran out before the tree did
+
+        llvm::FunctionType *function_type(uint32_t arg_count) {
+            return llvm::FunctionType::get(double_type,
+                    std::vector<llvm::Type *>(arg_count, double_type), false);
+        }
+
+    public:
+        llvm_codegen(const function_ast &fn, const program::resolution &names,
+                const function_table &table, native_runtime &runtime, llvm::LLVMContext &context) :
+            expr_visitor(fn.nodes()), context(context), builder(context), names(names),
+            table(table), runtime(runtime), double_type(llvm::Type::getDoubleTy(context)) {}
+
+        // visit - the value of ref, or a placeholder once the native stack
+        // runs out, after which emit fails
+        llvm::Value *visit(expr_ref ref) {
+            if (exhausted || stack_exhausted()) {
+                exhausted = true;
+                return llvm::ConstantFP::get(double_type, 0.0);
+            }
+            return expr_visitor::visit(ref);
+        }
+
+        llvm::Value *visit_number(const number_expr_ast &node) {
+            return llvm::ConstantFP::get(double_type, node.value);
+        }
+
+        llvm::Value *visit_variable(const variable_expr_ast &node) {
+            return params[names.slots[node_index(node)]];
+        }
+
+        llvm::Value *visit_binary(const binary_expr_ast &node) {
+            size_t base = spine.size();
+            left_spine(pool, node, spine);
+            llvm::Value *value = visit(spine.back()->lhs);
+            for (size_t i = spine.size(); i-- > base;)
+                value = binary(spine[i]->op, value, visit(spine[i]->rhs));
+            spine.resize(base);
+            return value;
+        }
+
+        llvm::Value *binary(char op, llvm::Value *lhs, llvm::Value *rhs) {
+            switch (op) {
+                case '+': return builder.CreateFAdd(lhs, rhs, "addtmp");
+                case '-': return builder.CreateFSub(lhs, rhs, "subtmp");
+                case '*': return builder.CreateFMul(lhs, rhs, "multmp");
+                case '/': return builder.CreateFDiv(lhs, rhs, "divtmp");
+                case '<':
+                    return builder.CreateUIToFP(builder.CreateFCmpULT(lhs, rhs, "cmptmp"),
+                            double_type, "booltmp");
+                case '>':
+                    return builder.CreateUIToFP(builder.CreateFCmpUGT(lhs, rhs, "cmptmp"),
+                            double_type, "booltmp");
+            }
+            __builtin_unreachable(); // resolution rejects other operators
+        }
+
+        llvm::Value *visit_call(const call_expr_ast &node) {
+            std::vector<llvm::Value *> args;
+            for (expr_ref arg : pool.call_args(node))
+                args.push_back(visit(arg));
+            // the callee's current code is in its function table slot, which
+            // another thread may fill while this code runs
+            uint32_t target = names.targets[node_index(node)];
+            llvm::FunctionType *type = function_type(node.arg_count);
+            llvm::Type *pointer_type = type->getPointerTo();
+            llvm::LoadInst *loaded = builder.CreateLoad(pointer_type,
+                    constant_pointer(table.slot(target), pointer_type->getPointerTo()), "callee");
+            loaded->setAtomic(llvm::AtomicOrdering::Acquire);
+
+            llvm::Function *function = builder.GetInsertBlock()->getParent();
+            llvm::BasicBlock *loaded_block = builder.GetInsertBlock();
+            llvm::BasicBlock *empty_block = llvm::BasicBlock::Create(context, "empty", function);
+            llvm::BasicBlock *call_block = llvm::BasicBlock::Create(context, "call", function);
+            llvm::MDBuilder weights(context);
+            builder.CreateCondBr(builder.CreateIsNull(loaded), empty_block, call_block,
+                    weights.createBranchWeights(1, 1 << 20));
+            llvm::Type *runtime_type = builder.getInt8PtrTy();
+
+            if (runtime.tiered) {
+                // the callee is not compiled yet, so the VM runs it
+                builder.SetInsertPoint(empty_block);
+                llvm::Value *array = llvm::ConstantPointerNull::get(double_type->getPointerTo());
+                if (!args.empty()) {
+                    llvm::IRBuilder<> entry(&function->getEntryBlock(), function->getEntryBlock().begin());
+                    array = entry.CreateAlloca(double_type, builder.getInt32(args.size()), "args");
+                    for (size_t i = 0; i < args.size(); ++i)
+                        builder.CreateStore(args[i], builder.CreateConstGEP1_32(double_type, array, i));
+                }
+                llvm::Value *interpreted = call_host(reinterpret_cast<const void *>(&interpret_on_call),
+                        llvm::FunctionType::get(double_type, { runtime_type, builder.getInt32Ty(),
+                            double_type->getPointerTo() }, false),
+                        { constant_pointer(&runtime, runtime_type), builder.getInt32(target), array });
+                llvm::BasicBlock *merge_block = llvm::BasicBlock::Create(context, "merge", function);
+                builder.CreateBr(merge_block);
+                empty_block = builder.GetInsertBlock();
+
+                builder.SetInsertPoint(call_block);
+                llvm::Value *called = call_through(type, loaded, args);
+                builder.CreateBr(merge_block);
+
+                builder.SetInsertPoint(merge_block);
+                llvm::PHINode *value = builder.CreatePHI(double_type, 2, "calltmp");
+                value->addIncoming(called, call_block);
+                value->addIncoming(interpreted, empty_block);
+                return value;
+            }
+
+            // the callee is compiled now
+            builder.SetInsertPoint(empty_block);
+            llvm::Value *compiled = call_host(reinterpret_cast<const void *>(&compile_on_call),
+                    llvm::FunctionType::get(builder.getInt64Ty(),
+                        { runtime_type, builder.getInt32Ty() }, false),
+                    { constant_pointer(&runtime, runtime_type), builder.getInt32(target) });
+            compiled = builder.CreateIntToPtr(compiled, pointer_type);
+            builder.CreateBr(call_block);
+
+            builder.SetInsertPoint(call_block);
+            llvm::PHINode *callee = builder.CreatePHI(pointer_type, 2, "callee");
+            callee->addIncoming(loaded, loaded_block);
+            callee->addIncoming(compiled, empty_block);
+            return call_through(type, callee, args);
+        }
+
+        llvm::Value *visit_if(const if_expr_ast &node) {
+            llvm::Value *condition = builder.CreateFCmpONE(visit(node.condition),
+                    llvm::ConstantFP::get(double_type, 0.0), "ifcond");
+            llvm::Function *function = builder.GetInsertBlock()->getParent();
+            llvm::BasicBlock *then_block = llvm::BasicBlock::Create(context, "then", function);
+            llvm::BasicBlock *else_block = llvm::BasicBlock::Create(context, "else", function);
+            llvm::BasicBlock *merge_block = llvm::BasicBlock::Create(context, "ifcont", function);
+            builder.CreateCondBr(condition, then_block, else_block);
+
+            builder.SetInsertPoint(then_block);
+            llvm::Value *then_value = visit(node.then_expr);
+            builder.CreateBr(merge_block);
+            then_block = builder.GetInsertBlock();
+
+            builder.SetInsertPoint(else_block);
+            llvm::Value *else_value = visit(node.else_expr);
+            builder.CreateBr(merge_block);
+            else_block = builder.GetInsertBlock();
+
+            builder.SetInsertPoint(merge_block);
+            llvm::PHINode *phi = builder.CreatePHI(double_type, 2, "iftmp");
+            phi->addIncoming(then_value, then_block);
+            phi->addIncoming(else_value, else_block);
+            return phi;
+        }
+
+        // constant_pointer - address as a constant pointer of type
+        llvm::Value *constant_pointer(const void *address, llvm::Type *type) {
+            return builder.CreateIntToPtr(builder.getInt64(reinterpret_cast<uintptr_t>(address)), type);
+        }
+
+        // call_host - call the host function at address
+        llvm::CallInst *call_host(const void *address, llvm::FunctionType *type,
+                llvm::ArrayRef<llvm::Value *> args) {
+            return builder.CreateCall(type, constant_pointer(address, type->getPointerTo()), args);
+        }
+
+        // call_through - call generated code. Calls stay real calls so that
+        // unbounded recursion overflows the stack check instead of looping
+        // forever.
+        llvm::Value *call_through(llvm::FunctionType *type, llvm::Value *callee,
+                llvm::ArrayRef<llvm::Value *> args) {
+            llvm::CallInst *call = builder.CreateCall(type, callee, args, "calltmp");
+            call->setTailCallKind(llvm::CallInst::TCK_NoTail);
+            return call;
+        }
+
+        // check_stack - leave through stack_overflow if this frame is below
+        // the runtime's stack limit
+        void check_stack(llvm::Function *function) {
+            llvm::Value *frame = builder.CreatePtrToInt(builder.CreateIntrinsic(
+                        llvm::Intrinsic::frameaddress, { builder.getInt8PtrTy() },
+                        { builder.getInt32(0) }), builder.getInt64Ty(), "frame");
+            llvm::Value *limit = builder.CreateLoad(builder.getInt64Ty(),
+                    constant_pointer(&runtime.stack_limit, builder.getInt64Ty()->getPointerTo()),
+                    "limit");
+            llvm::BasicBlock *overflow = llvm::BasicBlock::Create(context, "overflow", function);
+            llvm::BasicBlock *body = llvm::BasicBlock::Create(context, "body", function);
+            builder.CreateCondBr(builder.CreateICmpULT(frame, limit), overflow, body);
+
+            builder.SetInsertPoint(overflow);
+            llvm::Type *runtime_type = builder.getInt8PtrTy();
+            llvm::CallInst *call = call_host(reinterpret_cast<const void *>(&stack_overflow),
+                    llvm::FunctionType::get(builder.getVoidTy(), { runtime_type }, false),
+                    { constant_pointer(&runtime, runtime_type) });
+            call->setDoesNotReturn();
+            builder.CreateUnreachable();
+
+            builder.SetInsertPoint(body);
+        }
+
+        // emit - the IR function called name for fn in module, or null if fn
+        // is nested too deeply to emit on the native stack
+        llvm::Function *emit(const function_ast &fn, const std::string &name, llvm::Module &module) {
+            const prototype_ast &proto = fn.get_proto();
+            llvm::Function *function = llvm::Function::Create(function_type(proto.arg_count),
+                    llvm::Function::ExternalLinkage, name, module);
+            for (llvm::Argument &arg : function->args())
+                params.push_back(&arg);
+            builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", function));
+            check_stack(function);
+            builder.CreateRet(visit(fn.get_body()));
+            if (exhausted) {
+                function->eraseFromParent();
+                return nullptr;
+            }
+            return function;
+        }
+
+        // emit_entry - a function called name that calls function with the
+        // arguments in the array it takes, for code that runs generated code
+        void emit_entry(llvm::Function *function, const std::string &name, llvm::Module &module) {
+            llvm::Type *array_type = double_type->getPointerTo();
+            llvm::Function *entry = llvm::Function::Create(
+                    llvm::FunctionType::get(double_type, { array_type }, false),
+                    llvm::Function::ExternalLinkage, name, module);
+            builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", entry));
+            std::vector<llvm::Value *> args;
+            for (unsigned i = 0; i < function->arg_size(); ++i)
+                args.push_back(builder.CreateLoad(double_type,
+                            builder.CreateConstGEP1_32(double_type, entry->getArg(0), i)));
+            builder.CreateRet(builder.CreateCall(function, args));
+        }
+};
+
+// native_jit - compiles a program's functions to native code with LLJIT.
+// Every compiled definition is added to the JIT under its own resource
+// tracker, which is removed when a newer definition replaces it. Created
+// with a VM below it, it is the tier that VM hands hot functions to, and
+// compiles them on a background thread.
+class native_jit {
+    public:
+        // tier - where a function's code stands
+        enum tier { interpreted, compiling, compiled };
+
+    private:
+        struct compiled_function {
+            llvm::orc::ResourceTrackerSP tracker; // for the code in the function's slot
+            uint32_t version = 0; // changes whenever the function's code is forgotten
+            tier state = interpreted;
+        };
+
+        // job - the IR of a hot function, for the background compiler
+        struct job {
+            uint32_t index;
+            uint32_t version;
+            std::string name;
+            llvm::orc::ThreadSafeModule module;
+        };
+
+        // optimize_limit - instructions beyond which a function is compiled
+        // without optimization, as instruction selection and scheduling grow
+        // faster than linearly with the size of its one long block
+        static constexpr unsigned optimize_limit = 10000;
+
+        const program &prog;
+        std::unique_ptr<llvm::orc::LLJIT> jit;
+        function_table table;
+        function_table entries; // entry points taking arguments as an array, when tiered
+        native_runtime runtime;
+        bytecode_vm *vm = nullptr; // the tier below, if any
+        native_tier hooks;
+        size_t module_count = 0;
+
+        // shared with the background compiler
+        mutable std::mutex lock;
+        std::condition_variable work;
+        std::vector<compiled_function> functions; // indexed by function index
+        std::deque<job> jobs;
+        bool stopping = false;
+        std::thread compiler;
+
+        explicit native_jit(const program &prog): prog(prog) {
+            runtime.jit = this;
+        }
+
+        bool jit_error(llvm::Error error) {
+            std::cerr << "JIT error: " << llvm::toString(std::move(error)) << "\n";
+            return false;
+        }
+
+        // optimize - the standard function simplification pipeline
+        static void optimize(llvm::Module &module) {
+            llvm::LoopAnalysisManager loops;
+            llvm::FunctionAnalysisManager functions;
+            llvm::CGSCCAnalysisManager cgscc;
+            llvm::ModuleAnalysisManager modules;
+            llvm::PassBuilder passes;
+            passes.registerModuleAnalyses(modules);
+            passes.registerCGSCCAnalyses(cgscc);
+            passes.registerFunctionAnalyses(functions);
+            passes.registerLoopAnalyses(loops);
+            passes.crossRegisterProxies(loops, functions, cgscc, modules);
+            passes.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2).run(module, modules);
+        }
+
+        // emit - the IR of fn in a module of its own, where its function is
+        // called name and its entry point name.entry if with_entry. The
+        // module is empty after an error, and too_deep says whether that was
+        // fn nesting too deeply to emit.
+        llvm::orc::ThreadSafeModule emit(const function_ast &fn, const program::resolution &names,
+                bool with_entry, std::string &name, bool &too_deep) {
+            auto context = std::make_unique<llvm::LLVMContext>();
+            name = "ks." + std::to_string(module_count++);
+            auto module = std::make_unique<llvm::Module>(name, *context);
+            module->setDataLayout(jit->getDataLayout());
+            llvm_codegen codegen(fn, names, table, runtime, *context);
+            llvm::Function *function = codegen.emit(fn, name, *module);
+            too_deep = !function;
+            if (!function || llvm::verifyFunction(*function, &llvm::errs()))
+                return llvm::orc::ThreadSafeModule();
+            if (function->getInstructionCount() > optimize_limit) {
+                function->addFnAttr(llvm::Attribute::OptimizeNone);
+                function->addFnAttr(llvm::Attribute::NoInline);
+            }
+            if (with_entry)
+                codegen.emit_entry(function, name + ".entry", *module);
+            return llvm::orc::ThreadSafeModule(std::move(module), std::move(context));
+        }
+
+        // load - optimize and compile module under tracker, returning the
+        // address of its symbol name or 0 after an error
+        uintptr_t load(llvm::orc::ThreadSafeModule module, const std::string &name,
+                llvm::orc::ResourceTrackerSP tracker) {
+            if (!module)
+                return 0;
+            module.withModuleDo([](llvm::Module &m) { optimize(m); });
+            if (llvm::Error error = jit->addIRModule(tracker, std::move(module)))
+                return jit_error(std::move(error));
+            return lookup(name);
+        }
+
+        // lookup - the address of the compiled symbol name, or 0 after an error
+        uintptr_t lookup(const std::string &name) {
+            auto symbol = jit->lookup(name);
+            if (!symbol)
+                return jit_error(symbol.takeError());
+            return symbol->getAddress();
+        }
+
+        // compile_hot_functions - the background compiler, which runs until
+        // the JIT is destroyed. It never holds lock while it compiles.
+        void compile_hot_functions() {
+            std::unique_lock<std::mutex> held(lock);
+            while (true) {
+                work.wait(held, [this] { return stopping || !jobs.empty(); });
+                if (stopping)
+                    return;
+                job next = std::move(jobs.front());
+                jobs.pop_front();
+                held.unlock();
+
+                llvm::orc::ResourceTrackerSP tracker = jit->getMainJITDylib().createResourceTracker();
+                uintptr_t address = load(std::move(next.module), next.name, tracker);
+                uintptr_t entry = address ? lookup(next.name + ".entry") : 0;
+
+                held.lock();
+                compiled_function &function = functions[next.index];
+                if (function.version != next.version) {
+                    // redefined while it was compiled
+                } else if (entry) {
+                    function.tracker = std::move(tracker);
+                    function.state = compiled;
+                    table.set(next.index, address);
+                    entries.set(next.index, entry);
+                    continue;
+                } else {
+                    function.state = interpreted;
+                }
+                held.unlock();
+                if (llvm::Error error = tracker->remove())
+                    jit_error(std::move(error));
+                held.lock();
+            }
+        }
+
+        // forget - empty function index's slot and free its code
+        void forget(uint32_t index) {
+            if (!table.has_room_for(index))
+                return;
+            llvm::orc::ResourceTrackerSP old_code;
+            {
+                std::lock_guard<std::mutex> held(lock);
+                if (index >= functions.size())
+                    return;
+                compiled_function &function = functions[index];
+                ++function.version;
+                function.state = interpreted;
+                old_code = std::move(function.tracker);
+                table.set(index, 0);
+                entries.set(index, 0);
+            }
+            if (old_code) {
+                if (llvm::Error error = old_code->remove())
+                    jit_error(std::move(error));
+            }
+        }
+
+        // call - run the entry point at address on args, or say why it could
+        // not finish
+        native_runtime::failure call(uintptr_t address, const double *args, double &result) {
+            if (int failure = setjmp(runtime.exit))
+                return native_runtime::failure(failure);
+            result = reinterpret_cast<double (*)(const double *)>(address)(args);
+            return native_runtime::none;
+        }
+
+        // enter - call, nested within the runs already active
+        native_runtime::failure enter(uintptr_t address, const double *args, double &result) {
+            jmp_buf outer;
+            memcpy(outer, runtime.exit, sizeof outer);
+            if (runtime.runs++ == 0)
+                runtime.stack_limit = stack_floor();
+            native_runtime::failure failure = call(address, args, result);
+            --runtime.runs;
+            memcpy(runtime.exit, outer, sizeof outer);
+            return failure;
+        }
+
+        // report - say why a run did not finish at location; false if it did not
+        bool report(native_runtime::failure failure, uint32_t location) {
+            if (failure == native_runtime::overflow) {
+                report_error(std::cerr, prog.buffer(), location, "call stack overflow");
+            } else if (failure == native_runtime::uncallable) {
+                const program::function_entry &entry = prog.function(runtime.uncallable_function);
+                report_error(std::cerr, prog.buffer(), location, "cannot call " +
+                        std::string(prog.symbol_names().name(entry.name)) +
+                        ", it has errors or no definition");
+            } else if (failure == native_runtime::too_deep) {
+                const program::function_entry &entry = prog.function(runtime.uncallable_function);
+                report_error(std::cerr, prog.buffer(), location,
+                        std::string(prog.symbol_names().name(entry.name)) + " is nested too deeply to compile");
+            }
+            return failure == native_runtime::none;
+        }
+
+        // the native_tier hooks for the VM below
+        static void promote_hot(void *owner, uint32_t index) {
+            static_cast<native_jit *>(owner)->promote(index);
+        }
+
+        static bool call_compiled(void *owner, uintptr_t entry, const double *args,
+                uint32_t location, double &result) {
+            native_jit &self = *static_cast<native_jit *>(owner);
+            return self.report(self.enter(entry, args, result), location);
+        }
+
+    public:
+        // create - a JIT for the host, or null if LLVM cannot target it. With
+        // a VM it is that VM's tier above, compiling functions once the VM
+        // has called them threshold times.
+        static std::unique_ptr<native_jit> create(const program &prog, bytecode_vm *vm = nullptr,
+                uint32_t threshold = 0) {
+            llvm::InitializeNativeTarget();
+            llvm::InitializeNativeTargetAsmPrinter();
+            std::unique_ptr<native_jit> result(new native_jit(prog));
+            if (!result->table.usable() || !result->entries.usable())
+                return nullptr;
+            auto jit = llvm::orc::LLJITBuilder().create();
+            if (!jit) {
+                result->jit_error(jit.takeError());
+                return nullptr;
+            }
+            result->jit = std::move(*jit);
+            if (vm) {
+                native_jit &self = *result;
+                self.vm = vm;
+                self.runtime.tiered = true;
+                self.hooks = { &self, std::max(threshold, 1u), self.entries.slot(0),
+                    promote_hot, call_compiled };
+                self.compiler = std::thread(&native_jit::compile_hot_functions, &self);
+                vm->set_tier(&self.hooks);
+            }
+            return result;
+        }
+
+        ~native_jit() {
+            if (vm)
+                vm->set_tier(nullptr);
+            {
+                std::lock_guard<std::mutex> held(lock);
+                stopping = true;
+            }
+            work.notify_one();
+            if (compiler.joinable())
+                compiler.join();
+        }
+
+        native_jit(const native_jit &) = delete;
+        native_jit &operator=(const native_jit &) = delete;
+
+        // tier_of - where function index's code stands
+        tier tier_of(uint32_t index) const {
+            std::lock_guard<std::mutex> held(lock);
+            return index < functions.size() ? functions[index].state : interpreted;
+        }
+
+        // compile - the address of function index's code, compiling it if
+        // its slot is empty; 0 if it has no definition that can run, or with
+        // too_deep set if it is nested too deeply to compile
+        uintptr_t compile(uint32_t index, bool &too_deep) {
+            if (!table.has_room_for(index))
+                return 0;
+            if (uintptr_t address = table.get(index))
+                return address;
+            const program::function_entry &entry = prog.function(index);
+            uintptr_t address = 0;
+            llvm::orc::ResourceTrackerSP tracker;
+            if (entry.native) {
+                address = reinterpret_cast<uintptr_t>(entry.native->address);
+            } else if (entry.fn && !entry.fn->is_extern() && entry.names.resolved) {
+                tracker = jit->getMainJITDylib().createResourceTracker();
+                std::string name;
+                address = load(emit(*entry.fn, entry.names, false, name, too_deep), name, tracker);
+            }
+            std::lock_guard<std::mutex> held(lock);
+            if (index >= functions.size())
+                functions.resize(prog.size());
+            if (address && tracker) {
+                functions[index].tracker = std::move(tracker);
+                functions[index].state = compiled;
+            }
+            table.set(index, address);
+            return address;
+        }
+
+        // promote - queue hot function index for the background compiler
+        void promote(uint32_t index) {
+            const program::function_entry &entry = prog.function(index);
+            if (!entry.fn || entry.fn->is_extern() || !entry.names.resolved || !table.has_room_for(index))
+                return;
+            // one nested too deeply to compile stays in the VM
+            std::string name;
+            bool too_deep;
+            llvm::orc::ThreadSafeModule module = emit(*entry.fn, entry.names, true, name, too_deep);
+            if (!module)
+                return;
+            std::lock_guard<std::mutex> held(lock);
+            if (index >= functions.size())
+                functions.resize(prog.size());
+            compiled_function &function = functions[index];
+            if (function.state != interpreted)
+                return;
+            function.state = compiling;
+            jobs.push_back({ index, function.version, std::move(name), std::move(module) });
+            work.notify_one();
+        }
+
+        // interpret - run function index in the VM below for generated code
+        bool interpret(uint32_t index, const double *args, double &result) {
+            return vm->call(index, args, result);
+        }
+
+        // defined - function index was (re)defined, which rechecked its
+        // callers. Their code is stale and is compiled again when it is next
+        // needed; nothing runs while definitions change, so it can be freed.
+        // A builtin needs no compiling, so its slot is filled at once: in
+        // tiered code an empty slot would send its calls to the VM.
+        void defined(uint32_t index) {
+            forget(index);
+            for (uint32_t caller : prog.function(index).callers)
+                forget(caller);
+            if (const builtin *native = prog.function(index).native) {
+                if (table.has_room_for(index))
+                    table.set(index, reinterpret_cast<uintptr_t>(native->address));
+            }
+        }
+
+        // run - compile and run a top-level expression; false after an error
+        bool run(const function_ast &fn, const program::resolution &names, double &result) {
+            std::string name;
+            bool too_deep;
+            llvm::orc::ThreadSafeModule module = emit(fn, names, true, name, too_deep);
+            if (too_deep) {
+                report_error(std::cerr, prog.buffer(), fn.get_proto().location,
+                        "expression is nested too deeply to compile");
+                return false;
+            }
+            llvm::orc::ResourceTrackerSP tracker = jit->getMainJITDylib().createResourceTracker();
+            uintptr_t address = load(std::move(module), name, tracker) ? lookup(name + ".entry") : 0;
+            native_runtime::failure failure = address ? enter(address, nullptr, result) : native_runtime::none;
+            if (llvm::Error error = tracker->remove())
+                jit_error(std::move(error));
+            return report(failure, fn.get_proto().location) && address != 0;
+        }
+};
+
+// compile_on_call - the code for function index, called by generated code
+// that found its slot empty
+static uintptr_t compile_on_call(native_runtime *runtime, uint32_t index) {
+    bool too_deep = false;
+    uintptr_t address = runtime->jit->compile(index, too_deep);
+    if (!address) {
+        runtime->uncallable_function = index;
+        longjmp(runtime->exit, too_deep ? native_runtime::too_deep : native_runtime::uncallable);
+    }
+    return address;
+}
+
+// interpret_on_call - the value of function index on args, called by tiered
+// generated code that found its slot empty
+static double interpret_on_call(native_runtime *runtime, uint32_t index, const double *args) {
+    double result;
+    if (!runtime->jit->interpret(index, args, result))
+        longjmp(runtime->exit, native_runtime::reported);
+    return result;
+}
+#endif
+
+// Top-level parsing
+
+// report_parsed - print fn with --dump-ast, otherwise say what was parsed.
+// False if fn is nested too deeply to print.
+static bool report_parsed(const source_buffer &source, const symbol_table &symbols,
+        const function_ast &fn, bool dump_ast) {
+    if (dump_ast) {
+        // printed whole or not at all
+        std::ostringstream text;
+        if (!ast_printer(fn.nodes(), symbols, text).print(fn)) {
+            report_error(std::cerr, source, fn.get_proto().location, "expression is nested too deeply to print");
+            return false;
+        }
+        std::cout << text.str();
+    } else if (fn.is_extern())
+        fprintf(stderr, "Parsed an extern.\n");
+    else if (fn.get_name() == symbol_table::anonymous)
+        fprintf(stderr, "Parsed a top-level expression.\n");
+    else
+        fprintf(stderr, "Parsed a function definition.\n");
+    return true;
+}
+
+// handle_item - parse the definition, extern or top-level expression at the
+// current token and report it. Returns null after an error.
+static std::unique_ptr<function_ast> handle_item(parser &p, bool dump_ast) {
+    std::unique_ptr<function_ast> fn;
+    switch (p.current()) {
+        case tok_def:
+            fn = p.parse_definition();
+            break;
+        case tok_extern:
+            fn = p.parse_extern();
+            break;
+        default:
+            // evaluate a top-level expression into an anonymous function
+            fn = p.parse_top_level_expr();
+            break;
+    }
+    if (fn)
+        return report_parsed(p.buffer(), p.symbol_names(), *fn, dump_ast) ? std::move(fn) : nullptr;
+    if (p.current() != tok_def && p.current() != tok_extern)
+        p.get_next_token(); // skip token for error recovery, but not the next item
+    return fn;
+}
+
+// engines - the ways top-level expressions can be evaluated. The tiered
+// engine runs functions in the VM until they have been called
+// jit_threshold times, and then as native code.
+struct engines {
+    enum kind { tree, bytecode, native, tiered };
+
+    // default_jit_threshold - VM calls before the tiered engine compiles a function
+    static constexpr uint32_t default_jit_threshold = 1000;
+
+    kind selected = bytecode;
+    uint32_t jit_threshold = default_jit_threshold;
+    interpreter interp;
+    bytecode_vm vm;
+#ifdef KALEIDOSCOPE_LLVM
+    std::unique_ptr<native_jit> jit;
+#endif
+
+    explicit engines(const program &prog): interp(prog), vm(prog, &interp) {}
+
+    // select - use engine kind, false if it is not available
+    bool select(const program &prog, kind engine) {
+#ifdef KALEIDOSCOPE_LLVM
+        jit.reset();
+        if (engine == native)
+            jit = native_jit::create(prog);
+        else if (engine == tiered)
+            jit = native_jit::create(prog, &vm, jit_threshold);
+        if ((engine == native || engine == tiered) && !jit)
+            return false;
+#else
+        (void)prog;
+        if (engine == native || engine == tiered)
+            return false;
+#endif
+        selected = engine;
+        return true;
+    }
+
+    // defined - function index was (re)defined
+    void defined(uint32_t index) {
+#ifdef KALEIDOSCOPE_LLVM
+        if (jit)
+            jit->defined(index);
+#else
+        (void)index;
+#endif
+    }
+
+    bool run(const function_ast &fn, const program::resolution &names, double &result) {
+        switch (selected) {
+            case tree:
+                return interp.run(fn, names, result);
+            case bytecode:
+            case tiered:
+                return vm.run(fn, names, result);
+            case native:
+#ifdef KALEIDOSCOPE_LLVM
+                return jit->run(fn, names, result);
+#endif
+                break;
+        }
+        return false;
+    }
+
+    // tier_of - where function index runs, for --stats
+    const char *tier_of(const program &prog, uint32_t index) const {
+        const program::function_entry &entry = prog.function(index);
+        if (entry.native)
+            return "builtin";
+        if (!entry.names.resolved)
+            return "errors";
+        switch (selected) {
+            case tree:
+                return "tree";
+            case bytecode:
+                return "vm";
+            case native:
+            case tiered:
+#ifdef KALEIDOSCOPE_LLVM
+                switch (jit->tier_of(index)) {
+                    case native_jit::interpreted:
+                        return selected == tiered ? "vm" : "not compiled";
+                    case native_jit::compiling:
+                        return "compiling";
+                    case native_jit::compiled:
+                        return "native";
+                }
+#endif
+                break;
+        }
+        return "";
+    }
+
+    // print_stats - the tier of every function the program defines, with
+    // the calls the tiered engine has counted in the VM
+    void print_stats(const program &prog) const {
+        fprintf(stderr, "%-24s %-14s %10s\n", "function", "tier", "vm calls");
+        for (uint32_t index = 0; index < prog.size(); ++index) {
+            const program::function_entry &entry = prog.function(index);
+            if (!entry.fn)
+                continue;
+            std::string name(prog.symbol_names().name(entry.name));
+            if (selected == tiered && !entry.native)
+                fprintf(stderr, "%-24s %-14s %10u\n", name.c_str(), tier_of(prog, index), vm.calls(index));
+            else
+                fprintf(stderr, "%-24s %-14s %10s\n", name.c_str(), tier_of(prog, index), "-");
+        }
+    }
+};
+
+// process_item - define fn in prog, or evaluate it if it is a top-level
+// expression. owned is fn if prog should take it over, otherwise null.
+static void process_item(program &prog, engines &engine, const function_ast &fn,
+        std::unique_ptr<function_ast> owned) {
+    if (fn.get_name() == symbol_table::anonymous) {
+        program::resolution names;
+        double result;
+        if (prog.resolve_expression(fn, names) && engine.run(fn, names, result))
+            fprintf(stderr, "Evaluated to %f\n", result);
+        return;
+    }
+    bool redefined = prog.is_defined(fn.get_name());
+    size_t rechecked = owned ? prog.define(std::move(owned)) : prog.define(fn);
+    engine.defined(prog.lookup(fn.get_name()));
+    if (redefined && rechecked)
+        fprintf(stderr, "Redefined %s, rechecked %zu callers.\n",
+                std::string(prog.symbol_names().name(fn.get_name())).c_str(), rechecked);
+}
+
+// Benchmarks
+//
+// run_benchmarks generates synthetic corpora that stress different parts of
+// the lexer and parser, then times lexing them into a token stream (MB/s,
+// tokens/s) and parsing that stream (AST nodes/s, and the memory the parsed
+// functions hold) separately. It then times small recursive programs on each
+// execution engine. Each measurement is
+// repeated and the fastest run is reported.
+
+// bench_corpus - a generated input of roughly target_size bytes
+struct bench_corpus {
+    const char *name;
+    std::string text;
+};
+
+static std::vector<bench_corpus> make_bench_corpora(size_t target_size) {
+    std::vector<bench_corpus> corpora;
+
+    // many small definitions
+    std::string defs;
+    for (size_t i = 0; defs.size() < target_size; ++i)
+        defs += "def f" + std::to_string(i) + "(a b c) a*b + c - " +
+            std::to_string(i % 97) + ".5 / (a + f" + std::to_string(i / 2) + "(b, c, 1));\n";
+    corpora.push_back({ "small defs", std::move(defs) });
+
+    // one huge expression
+    std::string huge = "def huge(x y) x";
+    const char ops[] = "+-*/<>";
+    for (size_t i = 0; huge.size() < target_size; ++i)
+        huge += std::string(" ") + ops[i % 6] + (i % 3 ? " y" : " 2.25") + std::to_string(i % 10);
+    huge += ";\n";
+    corpora.push_back({ "huge expression", std::move(huge) });
+
+    // deeply nested parentheses, just under the default nesting limit
+    std::string nested;
+    const size_t depth = parser::default_max_depth - 1;
+    while (nested.size() < target_size)
+        nested += std::string(depth, '(') + "x" + std::string(depth, ')') + ";\n";
+    corpora.push_back({ "nested parens", std::move(nested) });
+
+    // long call argument lists
+    std::string calls;
+    while (calls.size() < target_size) {
+        calls += "call(";
+        for (int i = 0; i < 1000; ++i)
+            calls += (i ? ", a" : "a") + std::to_string(i);
+        calls += ");\n";
+    }
+    corpora.push_back({ "long arg lists", std::move(calls) });
+
+    // generated formulas that repeat their subexpressions
+    std::string formulas;
+    for (size_t i = 0; formulas.size() < target_size; ++i)
+        formulas += "def r" + std::to_string(i) + "(x y) (x*x + y*y) * (x*x + y*y) - " +
+            "(x*x + y*y) / (" + std::to_string(i % 13) + " + (x*x + y*y)) + " +
+            "norm(x*x + y*y, x - y) * norm(x*x + y*y, x - y);\n";
+    corpora.push_back({ "repeated terms", std::move(formulas) });
+
+    // mostly comments
+    std::string comments;
+    for (size_t i = 0; comments.size() < target_size; ++i) {
+        comments += "# generated coefficient table, row " + std::to_string(i) +
+            ": these lines only exercise the comment scanner\n";
+        if (i % 16 == 0)
+            comments += "def c" + std::to_string(i) + "(x) x * 0.125;\n";
+    }
+    corpora.push_back({ "comment heavy", std::move(comments) });
+
+    return corpora;
+}
+
+// parse_all - parse every top-level item of the stream, skipping errors.
+// Returns the bytes of AST storage the parsed functions used.
+static size_t parse_all(parser &p) {
+    size_t ast_bytes = 0;
+    p.get_next_token();
+    while (p.current() != tok_eof) {
+        std::unique_ptr<function_ast> fn;
+        switch (p.current()) {
+            case ';':
+                p.get_next_token();
+                continue;
+            case tok_def:
+                fn = p.parse_definition();
+                break;
+            case tok_extern:
+                fn = p.parse_extern();
+                break;
+            default:
+                fn = p.parse_top_level_expr();
+                break;
+        }
+        if (fn)
+            ast_bytes += sizeof(function_ast) + fn->nodes().memory_size();
+        else
+            p.get_next_token();
+    }
+    return ast_bytes;
+}
+
+// time_program - define the functions of text and return the seconds that
+// engine takes to evaluate its top-level expressions, the last of which
+// leaves its value in result. Returns a negative time after an error.
+static double time_program(const char *text, engines::kind kind, double &result) {
+    typedef std::chrono::steady_clock clock;
+    std::unique_ptr<source_buffer> source = source_buffer::from_string("<bench>", text);
+    symbol_table symbols;
+    lexer lex(*source, symbols);
+    token_stream tokens;
+    lex.lex_all(tokens);
+    parser p(lex, tokens);
+    program prog(*source, symbols);
+    engines engine(prog);
+    if (!engine.select(prog, kind))
+        return -1;
+
+    double seconds = 0;
+    p.get_next_token();
+    while (p.current() != tok_eof) {
+        if (p.current() == ';') {
+            p.get_next_token();
+            continue;
+        }
+        std::unique_ptr<function_ast> fn =
+            p.current() == tok_def ? p.parse_definition() : p.parse_top_level_expr();
+        if (!fn)
+            return -1;
+        if (fn->get_name() != symbol_table::anonymous) {
+            symbol name = fn->get_name();
+            prog.define(std::move(fn));
+            engine.defined(prog.lookup(name));
+            continue;
+        }
+        program::resolution names;
+        auto start = clock::now();
+        if (!prog.resolve_expression(*fn, names) || !engine.run(*fn, names, result))
+            return -1;
+        seconds += std::chrono::duration<double>(clock::now() - start).count();
+    }
+    return seconds;
+}
+
+// execution_benchmarks - recursive programs timed on every engine
+static const struct {
+    const char *name;
+    const char *text;
+} execution_benchmarks[] = {
+    { "fib(27)",
+        "def fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2);\n"
+        "fib(27);\n" },
+    { "integrate",
+        "def f(x) x*x*x - 2*x + 1;\n"
+        "def integrate(a b n) if n < 2 then (b - a) * f((a + b) * 0.5)\n"
+        "    else integrate(a, (a + b) * 0.5, n * 0.5) + integrate((a + b) * 0.5, b, n * 0.5);\n"
+        "integrate(0, 2, 1048576);\n" },
+};
+
+static int run_benchmarks(size_t target_size) {
+    typedef std::chrono::steady_clock clock;
+    const int repeats = 5;
+
+    printf("scan kernels: %s\n", scanners.name);
+    printf("%-16s %8s %10s %12s %12s %12s %10s %10s\n",
+            "corpus", "MB", "lex MB/s", "tokens/s", "nodes", "nodes/s", "AST MB", "DAG MB");
+
+    for (bench_corpus &corpus : make_bench_corpora(target_size)) {
+        double megabytes = corpus.text.size() / 1e6;
+        std::unique_ptr<source_buffer> source =
+            source_buffer::from_string(corpus.name, std::move(corpus.text));
+
+        double lex_seconds = 1e30, parse_seconds = 1e30;
+        size_t token_count = 0, node_count = 0, ast_bytes = 0, dag_bytes = 0;
+        for (int r = 0; r < repeats; ++r) {
+            symbol_table symbols;
+            lexer lex(*source, symbols);
+            token_stream tokens;
+            auto start = clock::now();
+            lex.lex_all(tokens);
+            auto lexed = clock::now();
+            parser p(lex, tokens);
+            ast_bytes = parse_all(p);
+            auto parsed = clock::now();
+
+            lex_seconds = std::min(lex_seconds,
+                    std::chrono::duration<double>(lexed - start).count());
+            parse_seconds = std::min(parse_seconds,
+                    std::chrono::duration<double>(parsed - lexed).count());
+            token_count = tokens.size();
+            node_count = p.nodes_built();
+        }
+
+        // the same corpus parsed with hash consing
+        {
+            symbol_table symbols;
+            lexer lex(*source, symbols);
+            token_stream tokens;
+            lex.lex_all(tokens);
+            parser p(lex, tokens);
+            p.set_hash_consing(true);
+            dag_bytes = parse_all(p);
+        }
+
+        printf("%-16s %8.2f %10.1f %12.4g %12zu %12.4g %10.2f %10.2f\n", corpus.name, megabytes,
+                megabytes / lex_seconds, token_count / lex_seconds,
+                node_count, node_count / parse_seconds, ast_bytes / 1e6, dag_bytes / 1e6);
+    }
+
+    // every engine is timed against the tree interpreter
+    static const struct {
+        engines::kind kind;
+        const char *name;
+    } timed[] = {
+        { engines::bytecode, "vm" },
+#ifdef KALEIDOSCOPE_LLVM
+        { engines::native, "jit" },
+        { engines::tiered, "tiered" },
+#endif
+    };
+    printf("\n%-16s %10s", "program", "tree ms");
+    for (const auto &engine : timed)
+        printf(" %10s %10s", (std::string(engine.name) + " ms").c_str(), "speedup");
+    printf(" %16s\n", "result");
+    for (const auto &bench : execution_benchmarks) {
+        double tree_seconds = 1e30, tree_result = 0;
+        for (int r = 0; r < repeats; ++r)
+            tree_seconds = std::min(tree_seconds, time_program(bench.text, engines::tree, tree_result));
+        if (tree_seconds < 0) {
+            fprintf(stderr, "%s: the tree interpreter failed\n", bench.name);
+            return 1;
+        }
+        printf("%-16s %10.1f", bench.name, tree_seconds * 1e3);
+        for (const auto &engine : timed) {
+            double seconds = 1e30, result = 0;
+            for (int r = 0; r < repeats; ++r)
+                seconds = std::min(seconds, time_program(bench.text, engine.kind, result));
+            if (seconds < 0 || result != tree_result) {
+                fprintf(stderr, "\n%s: the %s engine failed or disagrees\n", bench.name, engine.name);
+                return 1;
+            }
+            printf(" %10.1f %10.2f", seconds * 1e3, tree_seconds / seconds);
+        }
+        printf(" %16.10g\n", tree_result);
+    }
+    return 0;
+}
+
+// kaleidoscope [--dump-ast] [-j threads] [script.ks]
+// kaleidoscope --bench [megabytes]
+// Reads the script if one is given, otherwise an interactive session on stdin.
+// --dump-ast prints each parsed item instead of just reporting it.
+// A script is lexed on up to `threads` threads, by default one per core.
+// --bench runs the front-end benchmark on corpora of the given size.
+// --engine picks how top-level expressions are evaluated; jit and tiered need
+// a build with LLVM. --jit-threshold sets the calls after which the tiered
+// engine compiles a function, and --stats prints where each function ran.
+// The command :stats prints the same at any point of a session.
+int main(int argc, char **argv) {
+    const char *path = nullptr;
+    unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+    bool dump_ast = false;
+    bool hash_cons = false;
+    uint32_t max_depth = parser::default_max_depth;
+    std::vector<std::pair<char, int>> binops;
+    const char *cache_path = nullptr;
+#ifdef KALEIDOSCOPE_LLVM
+    engines::kind selected_engine = engines::tiered;
+#else
+    engines::kind selected_engine = engines::bytecode;
+#endif
+    uint32_t jit_threshold = engines::default_jit_threshold;
+    bool stats = false;
+    auto usage = [&]() {
+        std::cerr << "usage: " << argv[0] << " [--dump-ast] [--hash-cons] [--max-depth n] [--binop <op><precedence>]...\n"
+            << "       " << std::string(strlen(argv[0]), ' ') << " [--engine tree|vm|jit|tiered] [--jit-threshold calls] [--stats]\n"
+            << "       " << std::string(strlen(argv[0]), ' ') << " [-j threads] [[--cache file] script.ks]\n"
+            << "       " << argv[0] << " --bench [megabytes]\n"
+            << "--binop only changes how expressions parse, as --dump-ast shows; no engine\n"
+            << "can evaluate an operator it adds, so using one is an error.\n";
+        return 1;
+    };
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--bench") {
+            size_t megabytes = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+            return run_benchmarks((megabytes ? megabytes : 8) << 20);
+        } else if (arg == "--dump-ast") {
+            dump_ast = true;
+        } else if (arg == "--hash-cons") {
+            hash_cons = true;
+        } else if (arg == "-j" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            thread_count = atoi(argv[++i]);
+        } else if (arg == "--binop" && i + 1 < argc && argv[i + 1][0]) {
+            // --binop '|5' parses | as a binary operator of precedence 5
+            binops.emplace_back(argv[i + 1][0], atoi(argv[i + 1] + 1));
+            ++i;
+        } else if (arg == "--max-depth" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            max_depth = atoi(argv[++i]);
+        } else if (arg == "--engine" && i + 1 < argc) {
+            std::string_view name = argv[++i];
+            if (name == "tree")
+                selected_engine = engines::tree;
+            else if (name == "vm")
+                selected_engine = engines::bytecode;
+            else if (name == "jit")
+                selected_engine = engines::native;
+            else if (name == "tiered")
+                selected_engine = engines::tiered;
+            else
+                return usage();
+        } else if (arg == "--jit-threshold" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            jit_threshold = atoi(argv[++i]);
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cache_path = argv[++i];
+        } else if (!path && arg.substr(0, 1) != "-") {
+            path = argv[i];
+        } else {
+            return usage();
+        }
+    }
+    // the cache is keyed by the contents of a script file
+    if (cache_path && !path)
+        return usage();
+
+    std::unique_ptr<source_buffer> source =
+        path ? source_buffer::from_file(path) : source_buffer::from_stdin();
+    if (!source)
+        return 1;
+
+    symbol_table symbols;
+    lexer lex(*source, symbols);
+    token_stream tokens;
+    parser p(lex, tokens);
+    p.set_max_depth(max_depth);
+    p.set_hash_consing(hash_cons);
+    for (auto [op, precedence] : binops) {
+        if (!p.set_binop_precedence(op, precedence)) {
+            std::cerr << "cannot define '" << op << "' as a binary operator of precedence "
+                << precedence << "\n";
+            return 1;
+        }
+    }
+
+    // a cache made from this exact file replaces the whole front end
+    std::unique_ptr<ast_cache> cache;
+    program prog(*source, symbols);
+    engines engine(prog);
+    engine.jit_threshold = jit_threshold;
+    if (!engine.select(prog, selected_engine)) {
+        std::cerr << "the selected engine is not available in this build\n";
+        return 1;
+    }
+    if (cache_path && (cache = ast_cache::open(cache_path, *source, p.options(), symbols))) {
+        for (const function_ast &fn : cache->cached_functions()) {
+            if (report_parsed(*source, symbols, fn, dump_ast))
+                process_item(prog, engine, fn, nullptr);
+        }
+        if (stats)
+            engine.print_stats(prog);
+        return 0;
+    }
+    std::vector<std::unique_ptr<function_ast>> parsed;
+    bool cacheable = cache_path != nullptr;
+
+    // a file is lexed up front, in parallel if it has been read whole (a
+    // pipe has not), and an interactive session as it is typed
+    bool interactive = path == nullptr;
+    if (interactive)
+        fprintf(stderr, "ready> ");
+    else if (thread_count > 1 && source->complete())
+        lex_parallel(*source, symbols, tokens, thread_count);
+    else
+        lex.lex_all(tokens);
+    p.get_next_token();
+
+    while (true) {
+        if (interactive)
+            fprintf(stderr, "ready> ");
+        switch(p.current()) {
+            case tok_eof:
+                // only a file that parsed cleanly is cached, so that a warm
+                // start reports the same as a cold one
+                if (cacheable && !ast_cache::write(cache_path, *source, p.options(), symbols, parsed))
+                    std::cerr << "cannot write the AST cache " << cache_path << "\n";
+                if (stats)
+                    engine.print_stats(prog);
+                return 0;
+            case ';': // ignore top_level semicolons
+                p.get_next_token();
+                break;
+            case ':': {
+                // a command is not an item, so a cache could not replay it
+                cacheable = false;
+                std::string_view command;
+                if (!p.parse_command(command))
+                    break;
+                if (command == "stats")
+                    engine.print_stats(prog);
+                else
+                    std::cerr << "unknown command :" << command << "\n";
+                break;
+            }
+            default: {
+                std::unique_ptr<function_ast> fn = handle_item(p, dump_ast);
+                if (!fn) {
+                    cacheable = false;
+                    break;
+                }
+                // the cache needs every item, otherwise prog takes the definitions
+                const function_ast &item = *fn;
+                if (cacheable)
+                    parsed.push_back(std::move(fn));
+                process_item(prog, engine, item, std::move(fn));
+                break;
+            }
         }
     }
     return 0;
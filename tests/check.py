@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""check.py - run kaleidoscope on a script and compare what it prints with
+an expected file.
+
+  check.py [--cache] [--stack <KiB>] [--pad <KiB>] <kaleidoscope> <script> <expected> [options...]
+
+The script and the expected file are looked up next to this file, and the
+script is passed by name from there, so that diagnostics name it the same
+way on every machine. stdout is compared first, then stderr. With --cache
+the script runs twice with one AST cache, cold and then warm, and both
+runs must print the expected output. --stack runs it with that soft stack
+limit, so that a test can run out of stack without a huge script. --pad
+runs a copy of the script with a comment that long after every line, which
+leaves every diagnostic where it was but makes the file large enough for
+-j to lex it in several chunks.
+"""
+
+import os
+import resource
+import subprocess
+import sys
+import tempfile
+
+
+def run(kaleidoscope, script, options, stack, directory):
+    def limit_stack():
+        if stack is not None:
+            hard = resource.getrlimit(resource.RLIMIT_STACK)[1]
+            resource.setrlimit(resource.RLIMIT_STACK, (stack * 1024, hard))
+
+    done = subprocess.run([kaleidoscope] + options + [script], cwd=directory,
+            stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+            preexec_fn=limit_stack, timeout=120)
+    if done.returncode != 0:
+        print('exit status %d' % done.returncode)
+    return (done.stdout + done.stderr).decode()
+
+
+def pad_script(source, destination, pad):
+    comment = ' #' + 'x' * (pad * 1024)
+    with open(source) as f:
+        lines = f.read().splitlines()
+    with open(destination, 'w') as f:
+        for line in lines:
+            f.write(line + comment + '\n')
+
+
+def compare(expected, actual, what):
+    if actual == expected:
+        return True
+    print('%s differs from the expected output' % what)
+    print('--- expected\n%s--- actual\n%s' % (expected, actual))
+    return False
+
+
+def main(args):
+    cache, stack, pad = False, None, None
+    while args[:1] == ['--cache'] or (args[:1] in (['--stack'], ['--pad']) and len(args) > 1):
+        if args[0] == '--cache':
+            cache, args = True, args[1:]
+        elif args[0] == '--stack':
+            stack, args = int(args[1]), args[2:]
+        else:
+            pad, args = int(args[1]), args[2:]
+    if len(args) < 3:
+        print(__doc__)
+        return 2
+    kaleidoscope, script, expected_name = os.path.abspath(args[0]), args[1], args[2]
+    options = args[3:]
+    here = os.path.dirname(os.path.abspath(__file__))
+    with open(os.path.join(here, expected_name)) as f:
+        expected = f.read()
+
+    with tempfile.TemporaryDirectory() as directory:
+        where = here
+        if pad is not None:
+            pad_script(os.path.join(here, script), os.path.join(directory, script), pad)
+            where = directory
+        if not cache:
+            return 0 if compare(expected, run(kaleidoscope, script, options, stack, where), script) else 1
+        path = os.path.join(directory, 'ast.cache')
+        options = options + ['--cache', path]
+        cold = compare(expected, run(kaleidoscope, script, options, stack, where), 'the cold run')
+        if not os.path.exists(path):
+            print('the cold run wrote no cache')
+            return 1
+        warm = compare(expected, run(kaleidoscope, script, options, stack, where), 'the warm run')
+        return 0 if cold and warm else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))